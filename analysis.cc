@@ -0,0 +1,227 @@
+#define _POSIX_C_SOURCE 200809L
+#include "analysis.h"
+#include "device.h"
+#include "emulate.h"
+#include "elf.h"
+#include <signal.h>
+#include <bit>
+#include <map>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <cstdlib>
+
+using std::uint32_t;
+using std::uint64_t;
+
+cache_model::cache_model(uint32_t size, uint32_t ways, uint32_t line)
+  : sets{size / ways / line}, ways{ways}, line_shift{std::countr_zero(line)},
+    tags(std::size_t{sets}*ways), used(std::size_t{sets}*ways),
+    size{size} {}
+
+bool cache_model::access_line(uint32_t line) {
+  const std::size_t set = (line & (sets - 1)) * std::size_t{ways};
+  std::size_t victim = set;
+  clock++;
+  for(std::size_t i = set; i < set + ways; i++) {
+    if(used[i] && tags[i] == line) {
+      used[i] = clock;
+      return true;
+    }
+    if(used[i] < used[victim]) victim = i;
+  }
+  tags[victim] = line;
+  used[victim] = clock;
+  return false;
+}
+
+bool cache_model::access(uint32_t addr) {
+  const uint32_t first = addr >> line_shift;
+  const uint32_t last = (addr + 3) >> line_shift;
+  bool hit = access_line(first);
+  if(last != first) hit = access_line(last) && hit;
+  return hit;
+}
+
+branch_predictor::branch_predictor(uint32_t entries, bool gshare)
+  : counters(entries, 1), gshare{gshare} {}
+
+bool branch_predictor::predict(uint32_t pc, bool taken) {
+  const std::size_t mask = counters.size() - 1;
+  const std::size_t index = ((pc >> 2) ^ (gshare ? history : 0)) & mask;
+  std::uint8_t& counter = counters[index];
+  const bool correct = (counter >= 2) == taken;
+  if(taken && counter < 3) counter++;
+  else if(!taken && counter > 0) counter--;
+  history = (history << 1 | taken) & mask;
+  return correct;
+}
+
+analysis::counts& analysis::counts::operator+=(const counts& other) {
+  fetches += other.fetches;
+  fetch_misses += other.fetch_misses;
+  accesses += other.accesses;
+  access_misses += other.access_misses;
+  branches += other.branches;
+  mispredicts += other.mispredicts;
+  return *this;
+}
+
+analysis::analysis(std::optional<cache_model> icache,
+		   std::optional<cache_model> dcache,
+		   std::optional<branch_predictor> bpred)
+  : icache{std::move(icache)}, dcache{std::move(dcache)},
+    bpred{std::move(bpred)} {}
+
+unsigned analysis::block(const cpu_state&) {
+  return instructions | accesses;
+}
+
+void analysis::instruction(uint32_t pc, uint32_t inst) {
+  if(last_conditional && bpred) {
+    current->branches++;
+    current->mispredicts += !bpred->predict(last_pc, pc != last_pc + 4);
+  }
+  current = &per_pc[pc];
+  current->fetches++;
+  if(icache) current->fetch_misses += !icache->access(pc);
+  const enum opcode op = inst_opcode(inst);
+  last_pc = pc;
+  last_conditional = op == OP_BRANCH || (op >= OP_BEQ && op <= OP_BGT);
+}
+
+void analysis::data(uint32_t addr) {
+  if(!dcache) return;
+  current->accesses++;
+  current->access_misses += !dcache->access(addr);
+}
+
+void analysis::load(uint32_t addr, uint32_t, unsigned) {
+  data(addr);
+}
+
+void analysis::store(uint32_t addr, uint32_t, unsigned) {
+  data(addr);
+}
+
+static void print_rate(std::FILE * fp, const char * what, uint64_t events,
+		       uint64_t misses) {
+  std::fprintf(fp, "%llu %s, %llu missed (%.2f%%)\n",
+	       static_cast<unsigned long long>(events), what,
+	       static_cast<unsigned long long>(misses),
+	       events ? 100.0 * misses / events : 0.0);
+}
+
+void analysis::report(std::FILE * fp) {
+  counts total;
+  std::map<std::string, counts> per_function;
+  for(const auto& [pc, c] : per_pc) {
+    total += c;
+    const symbol * const sym = find_symbol(pc);
+    per_function[sym ? sym->name : "?"] += c;
+  }
+  if(icache) {
+    std::fprintf(fp, "I-cache (%lu bytes, %lu ways, %lu-byte lines): ",
+		 static_cast<unsigned long>(icache->size),
+		 static_cast<unsigned long>(icache->get_ways()),
+		 static_cast<unsigned long>(icache->get_line()));
+    print_rate(fp, "fetches", total.fetches, total.fetch_misses);
+  }
+  if(dcache) {
+    std::fprintf(fp, "D-cache (%lu bytes, %lu ways, %lu-byte lines): ",
+		 static_cast<unsigned long>(dcache->size),
+		 static_cast<unsigned long>(dcache->get_ways()),
+		 static_cast<unsigned long>(dcache->get_line()));
+    print_rate(fp, "accesses", total.accesses, total.access_misses);
+  }
+  if(bpred) {
+    std::fprintf(fp, "branch predictor (%s, %zu entries): ",
+		 bpred->is_gshare() ? "gshare" : "bimodal",
+		 bpred->get_entries());
+    print_rate(fp, "branches", total.branches, total.mispredicts);
+  }
+  const auto line = [&](const counts& c) {
+    std::fprintf(fp, "%12llu %10llu %12llu %10llu %12llu %10llu",
+		 static_cast<unsigned long long>(c.fetches),
+		 static_cast<unsigned long long>(c.fetch_misses),
+		 static_cast<unsigned long long>(c.accesses),
+		 static_cast<unsigned long long>(c.access_misses),
+		 static_cast<unsigned long long>(c.branches),
+		 static_cast<unsigned long long>(c.mispredicts));
+  };
+  const char * const header =
+    "     fetches    I-miss     accesses    D-miss     branches   mispred";
+  std::fprintf(fp, "\nper function:\n%s  function\n", header);
+  for(const auto& [name, c] : per_function) {
+    line(c);
+    std::fprintf(fp, "  %s\n", name.c_str());
+  }
+  std::vector<std::pair<uint32_t, counts>> pcs(per_pc.begin(), per_pc.end());
+  std::sort(pcs.begin(), pcs.end(), [](const auto& a, const auto& b) {
+    return a.first < b.first;
+  });
+  std::fprintf(fp, "\nper instruction:\n%s  address\n", header);
+  for(const auto& [pc, c] : pcs) {
+    line(c);
+    std::fprintf(fp, "  0x%08lx", static_cast<unsigned long>(pc));
+    if(const auto sym = symbolize(pc); !sym.empty())
+      std::fprintf(fp, " <%s>", sym.c_str());
+    std::fputs(": ", fp);
+    print_inst(get_word(pc), fp);
+  }
+}
+
+void analysis::save(std::FILE * fp) const {
+  for(const auto& [pc, c] : per_pc) {
+    std::fwrite(&pc, sizeof(pc), 1, fp);
+    std::fwrite(&c, sizeof(c), 1, fp);
+  }
+}
+
+void analysis::merge(std::FILE * fp) {
+  uint32_t pc;
+  counts c;
+  while(std::fread(&pc, sizeof(pc), 1, fp) == 1
+	&& std::fread(&c, sizeof(c), 1, fp) == 1)
+    per_pc[pc] += c;
+}
+
+static CPU * analysed_cpu;
+static std::unique_ptr<analysis> analyser;
+static const char * report_name;
+
+static void interrupt_handler(int) {
+  analysed_cpu->interrupt();
+}
+
+static void finish_analysis() {
+  if(!analyser) return;
+  std::FILE * const fp = report_name ? std::fopen(report_name, "w") : stderr;
+  if(!fp) std::perror(report_name);
+  else {
+    analyser->report(fp);
+    if(fp != stderr) std::fclose(fp);
+  }
+  analyser.reset();
+}
+
+/* Analyses the CPU until the program exits, writing the report to the named
+   file or to stderr.  As with the profiler, the first SIGINT stops the CPU so
+   that the report can still be written. */
+analysis& start_analysis(CPU& cpu, std::optional<cache_model> icache,
+			 std::optional<cache_model> dcache,
+			 std::optional<branch_predictor> bpred,
+			 const char * name, bool observe) {
+  analysed_cpu = &cpu;
+  report_name = name;
+  analyser = std::make_unique<analysis>(std::move(icache), std::move(dcache),
+					std::move(bpred));
+  if(observe) cpu.observe(*analyser);
+  struct sigaction sa;
+  sa.sa_handler = interrupt_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESETHAND;
+  sigaction(SIGINT, &sa, NULL);
+  std::atexit(finish_analysis);
+  return *analyser;
+}
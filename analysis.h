@@ -0,0 +1,100 @@
+// -*- C++ -*-
+#ifndef ANALYSIS_H_
+#define ANALYSIS_H_
+#include "cpu.h"
+#include <vector>
+#include <optional>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdint>
+
+/* A set-associative cache with LRU replacement that allocates on every
+   miss. */
+class cache_model {
+  const std::uint32_t sets;
+  const std::uint32_t ways;
+  const int line_shift;
+  std::vector<std::uint32_t> tags;
+  std::vector<std::uint64_t> used;
+  std::uint64_t clock = 0;
+
+  bool access_line(std::uint32_t);
+
+public:
+  const std::uint32_t size;
+
+  cache_model(std::uint32_t, std::uint32_t, std::uint32_t);
+
+  std::uint32_t get_ways() const { return ways; }
+  std::uint32_t get_line() const { return std::uint32_t{1} << line_shift; }
+
+  /* Returns whether the word at the address hit. */
+  bool access(std::uint32_t);
+};
+
+/* A table of two-bit saturating counters, indexed by the branch address
+   alone (bimodal) or hashed with the global history (gshare). */
+class branch_predictor {
+  std::vector<std::uint8_t> counters;
+  const bool gshare;
+  std::uint32_t history = 0;
+
+public:
+  branch_predictor(std::uint32_t, bool);
+
+  std::size_t get_entries() const { return counters.size(); }
+  bool is_gshare() const { return gshare; }
+
+  /* Updates the predictor with the outcome, returning whether it was
+     predicted correctly. */
+  bool predict(std::uint32_t, bool);
+};
+
+/* Feeds the fetch, data and branch streams of a CPU into the models, counting
+   events per instruction address. */
+class analysis final : public observer {
+  struct counts {
+    std::uint64_t fetches = 0, fetch_misses = 0;
+    std::uint64_t accesses = 0, access_misses = 0;
+    std::uint64_t branches = 0, mispredicts = 0;
+
+    counts& operator+=(const counts&);
+  };
+
+  std::optional<cache_model> icache;
+  std::optional<cache_model> dcache;
+  std::optional<branch_predictor> bpred;
+  std::unordered_map<std::uint32_t, counts> per_pc;
+  counts * current = nullptr;
+  std::uint32_t last_pc = 0;
+  bool last_conditional = false;
+
+  void data(std::uint32_t);
+
+  unsigned block(const cpu_state&) override;
+  void instruction(std::uint32_t, std::uint32_t) override;
+  void load(std::uint32_t, std::uint32_t, unsigned) override;
+  void store(std::uint32_t, std::uint32_t, unsigned) override;
+
+public:
+  analysis(std::optional<cache_model>, std::optional<cache_model>,
+	   std::optional<branch_predictor>);
+
+  void report(std::FILE*);
+
+  /* Writes the counts for merge to add to those of another analysis of the
+     same program by the same build. */
+  void save(std::FILE*) const;
+  void merge(std::FILE*);
+
+  void clear() { per_pc.clear(); }
+};
+
+/* The CPU is observed unless the last argument is false, when something else
+   is to feed the analysis. */
+analysis& start_analysis(CPU&, std::optional<cache_model>,
+			 std::optional<cache_model>,
+			 std::optional<branch_predictor>, const char*,
+			 bool = true);
+
+#endif
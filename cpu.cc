@@ -1,6 +1,9 @@
 #include "cpu.h"
 #include "device.h"
 #include "emulate.h"
+#include "elf.h"
+#include "record.h"
+#include "isa.h"
 #include <unistd.h>
 #include <iostream>
 #include <utility>
@@ -16,6 +19,10 @@
 using namespace std::literals::string_view_literals;
 using std::uint32_t;
 
+bool extended_isa = false;
+
+std::atomic_bool CPU::exiting{false};
+
 static std::size_t accept(std::span<char> buf) {
   assert(buf.size() > 0);
   std::size_t read = 0;
@@ -71,10 +78,10 @@ public:
     friend class command_line;
   };
 
-  explicit command_line(std::istream& stream)
+  command_line(std::istream& stream, bool interactive)
     : line{[&]() {
       std::array<char, command_line_length> res;
-      if(isatty(0)) accept(std::span{res.data(), res.size()});
+      if(interactive) accept(std::span{res.data(), res.size()});
       else
 	stream.getline(res.data(), res.size());
       res[res.size() - 1] = 0;
@@ -105,6 +112,15 @@ public:
       return std::nullopt;
     return argument{*this, n + 1};
   }
+
+  /* Returns the arguments from the nth onwards as written. */
+  std::string_view get_args(int n) {
+    if(static_cast<std::size_t>(n + 1) >= tokens.size())
+      return {};
+    return std::string_view{tokens[n + 1].first, tokens.back().second};
+  }
+
+  const char * get_line() const { return line.data(); }
 };
 
 static void print_num(uint32_t num) {
@@ -112,31 +128,238 @@ static void print_num(uint32_t num) {
 	    << std::dec << " (" << num << ")\n";
 }
 
+void CPU::drive(scheduler& s) {
+  sched = &s;
+  s.set_clock(published_retired);
+}
+
+CPU::block_accesses CPU::decode_block(uint32_t start, uint32_t end) {
+  block_accesses res{start, end};
+  for(uint32_t addr = start; addr - start <= end - start; addr += 4) {
+    const std::optional<uint32_t> inst = peek_word(addr);
+    if(!inst) continue;
+    switch(inst_opcode(*inst)) {
+    case OP_LOAD:
+    case OP_LOADB:
+    case OP_LOADBS:
+    case OP_LOADH:
+    case OP_LOADHS:
+      res.loads++;
+      break;
+    case OP_STORE:
+    case OP_STOREB:
+    case OP_STOREH:
+      res.stores++;
+      break;
+    default:
+      break;
+    }
+  }
+  return res;
+}
+
+void CPU::observe_blocks(observer& o) {
+  if(obs && !fanout) {
+    fanout = std::make_unique<observers>();
+    fanout->add(*obs);
+    obs = fanout.get();
+  }
+  if(fanout) fanout->add(o);
+  else obs = &o;
+}
+
+void CPU::observe(observer& o) {
+  observe_blocks(o);
+  instrumented = true;
+}
+
+void CPU::record(recorder& r) {
+  rec = &r;
+  observe(r);
+}
+
 void CPU::add_breakpoint(uint32_t addr) {
   breakpoints.push_back({ next_breakpoint++, addr });
 }
 
+static std::vector<std::string_view> split(std::string_view text) {
+  std::vector<std::string_view> res;
+  const auto isspace = [](char c) { return std::isspace(c) != 0; };
+  for(auto it = text.begin(); it != text.end();) {
+    it = std::find_if_not(it, text.end(), isspace);
+    if(it == text.end()) break;
+    const auto end = std::find_if(it, text.end(), isspace);
+    res.emplace_back(it, end);
+    it = end;
+  }
+  return res;
+}
+
+static std::optional<uint32_t> parse_number(std::string_view text) {
+  const std::string str{text};
+  char * end;
+  const uint32_t res = strtoul(str.c_str(), &end, 0);
+  if(str.empty() || *end) return std::nullopt;
+  return res;
+}
+
+std::optional<CPU::operand> CPU::parse_operand(std::string_view text) {
+  if(text.size() == 2 && text[0] == 'r' && text[1] >= '0' && text[1] <= '7')
+    return operand{operand::reg, 4, false, static_cast<uint32_t>(text[1] - '0')};
+  for(const auto& [prefix, size] : {std::pair{"byte["sv, 1u},
+				    std::pair{"hword["sv, 2u},
+				    std::pair{"word["sv, 4u},
+				    std::pair{"["sv, 4u}})
+    if(text.starts_with(prefix) && text.ends_with(']')) {
+      const auto inner = text.substr(prefix.size(),
+				     text.size() - prefix.size() - 1);
+      const auto addr = parse_operand(inner);
+      if(!addr || addr->kind == operand::memory) return std::nullopt;
+      return operand{operand::memory, size, addr->kind == operand::reg,
+		     addr->value};
+    }
+  if(const auto num = parse_number(text))
+    return operand{operand::constant, 4, false, *num};
+  return std::nullopt;
+}
+
+bool CPU::add_breakpoint(std::string_view spec) {
+  const auto words = split(spec);
+  if(words.empty()) return false;
+  const auto addr = parse_number(words[0]);
+  if(!addr) return false;
+  breakpoint bp{ next_breakpoint, *addr };
+  if(words.size() > 1) {
+    if(words[1] != "if"sv || (words.size() - 2) % 4 != 3) return false;
+    for(std::size_t i = 2; i < words.size(); i += 4) {
+      if(i + 3 < words.size() && words[i + 3] != "&&"sv) return false;
+      static constexpr std::array ops{"=="sv, "!="sv, "<"sv, "<="sv, ">"sv,
+				      ">="sv};
+      const auto op = std::find(ops.begin(), ops.end(), words[i + 1]);
+      const auto lhs = parse_operand(words[i]);
+      const auto rhs = parse_operand(words[i + 2]);
+      if(op == ops.end() || !lhs || !rhs) return false;
+      bp.condition.push_back({*lhs, *rhs,
+			      static_cast<decltype(comparison::op)>
+			      (op - ops.begin())});
+    }
+    bp.text = std::string{words[2].begin(), words.back().end()};
+  }
+  next_breakpoint++;
+  breakpoints.push_back(std::move(bp));
+  return true;
+}
+
+std::optional<uint32_t>
+CPU::evaluate(const operand& o, const std::array<uint32_t, 8>& regs) {
+  switch(o.kind) {
+  case operand::reg:
+    return regs[o.value];
+  case operand::constant:
+    return o.value;
+  default:
+    { const uint32_t addr = o.indirect ? regs[o.value] : o.value;
+      const char * const bytes = host_range(addr, o.size, false);
+      if(!bytes) return {};
+      uint32_t res = 0;
+      for(unsigned i = 0; i < o.size; i++)
+	res |= uint32_t{static_cast<unsigned char>(bytes[i])} << i*8;
+      return res;
+    }
+  }
+}
+
+bool CPU::holds(const std::vector<comparison>& condition,
+		const std::array<uint32_t, 8>& regs) {
+  for(const auto& c : condition) {
+    const auto l = evaluate(c.lhs, regs);
+    const auto r = evaluate(c.rhs, regs);
+    if(!l || !r) return false;
+    const uint32_t lhs = *l, rhs = *r;
+    bool res;
+    switch(c.op) {
+    case comparison::eq:
+      res = lhs == rhs;
+      break;
+    case comparison::ne:
+      res = lhs != rhs;
+      break;
+    case comparison::lt:
+      res = lhs < rhs;
+      break;
+    case comparison::le:
+      res = lhs <= rhs;
+      break;
+    case comparison::gt:
+      res = lhs > rhs;
+      break;
+    default:
+      res = lhs >= rhs;
+    }
+    if(!res) return false;
+  }
+  return true;
+}
+
 void CPU::check_breakpoint(bool& single_step, uint32_t pc,
-			   std::vector<breakpoint>::const_iterator& it) {
+			   std::vector<breakpoint>::iterator& it,
+			   REGS_PARAMS) {
+  // Going back re-executes up to stop_at without stopping on the way.
+  if(stop_at != UINT64_MAX) {
+    if(pc == it->addr && it->num != -1 && retired < stop_at
+       && (it->condition.empty() || holds(it->condition, {REGS})))
+      rec->breakpoint_hit();
+    ++it;
+    return;
+  }
   if(pc == it->addr) {
-    single_step = true;
     if(it->num == -1) {
+      single_step = true;
       it = breakpoints.erase(it);
       return;
     }
-    std::cerr << "breakpoint " << it->num
-	      << " at 0x" << std::hex << it->addr << std::dec << '\n';
+    if(it->condition.empty() || holds(it->condition, {REGS})) {
+      it->hits++;
+      if(it->ignore > 0) it->ignore--;
+      else {
+	single_step = true;
+	std::cerr << "breakpoint " << it->num
+		  << " at 0x" << std::hex << it->addr << std::dec;
+	if(const auto sym = symbolize(it->addr); !sym.empty())
+	  std::cerr << " <" << sym << '>';
+	std::cerr << ", hit " << it->hits << '\n';
+      }
+    }
   }
   ++it;
 }
 
-void CPU::single_step(bool& single_step, uint32_t pc, uint32_t inst,
+void CPU::debug_script(std::unique_ptr<std::istream> stream) {
+  script = std::move(stream);
+  scripted = true;
+  stop_at_start = true;
+}
+
+bool CPU::single_step(bool& single_step, uint32_t pc, uint32_t inst,
 		      REGS_PARAMS) {
-  std::cerr << "0x" << std::hex << pc << std::dec << ": ";
+  if(retired == stop_at) {
+    stop_at = UINT64_MAX;
+    if(rec->reached()) return true;
+  }
+  std::cerr << "0x" << std::hex << pc << std::dec;
+  if(const auto sym = symbolize(pc); !sym.empty())
+    std::cerr << " <" << sym << '>';
+  std::cerr << ": ";
   print_inst(inst, stderr);
   while(true) {
+    if(script && script->peek() == EOF) script.reset();
+    if(scripted && !script && !isatty(0)) {
+      single_step = false;
+      break;
+    }
     std::cerr << "> ";
-    command_line cmdline{std::cin};
+    command_line cmdline{script ? *script : std::cin, !script && isatty(0)};
+    if(script) std::cerr << cmdline.get_line() << '\n';
     if(!cmdline.get_command()) continue;
     const auto mcmd = cmdline.get_command();
     if(!mcmd) continue;
@@ -157,6 +380,13 @@ void CPU::single_step(bool& single_step, uint32_t pc, uint32_t inst,
       return num;
     };
 
+    const auto can_reverse = [&]() {
+      if(!rec) std::cerr << "not recording\n";
+      else if(retired == 0) std::cerr << "at the start of the recording\n";
+      else return true;
+      return false;
+    };
+
     unsigned ri;
     bool byte, hword;
     if(cmd.size() == 2 && cmd[0] == 'r' && (ri = cmd[1] - '0') < 8) {
@@ -199,11 +429,39 @@ void CPU::single_step(bool& single_step, uint32_t pc, uint32_t inst,
     }
 
     else if(cmd == "b"sv || cmd == "break"sv) {
-      const auto addr = get_num(0);
-      if(!addr) continue;
-      add_breakpoint(*addr);
+      if(!add_breakpoint(cmdline.get_args(0)))
+	std::cerr << "usage: break ADDR [if OPERAND OP OPERAND [&& ...]]\n";
+    }
+
+    else if(cmd == "i"sv || cmd == "info"sv) {
+      for(const auto& bp : breakpoints) {
+	if(bp.num == -1) continue;
+	std::cerr << bp.num << ": 0x" << std::hex << bp.addr << std::dec;
+	if(const auto sym = symbolize(bp.addr); !sym.empty())
+	  std::cerr << " <" << sym << '>';
+	if(!bp.text.empty()) std::cerr << " if " << bp.text;
+	std::cerr << ", hit " << bp.hits;
+	if(bp.ignore) std::cerr << ", ignoring " << bp.ignore;
+	std::cerr << '\n';
+      }
     }
 
+    else if(cmd == "ignore"sv) {
+      const auto num = get_num(0);
+      if(!num) continue;
+      const auto count = get_num(1);
+      if(!count) continue;
+      const auto it = std::find_if(breakpoints.begin(), breakpoints.end(),
+				   [&](const auto& bp) {
+				     return bp.num == static_cast<int>(*num);
+				   });
+      if(it == breakpoints.end()) std::cerr << "no breakpoint " << *num << '\n';
+      else it->ignore = *count;
+    }
+
+    else if(cmd == "q"sv || cmd == "quit"sv)
+      std::exit(0);
+
     else if(cmd == "d"sv || cmd == "delete"sv) {
       const auto num = get_num(0);
       if(!num) continue;
@@ -230,6 +488,15 @@ void CPU::single_step(bool& single_step, uint32_t pc, uint32_t inst,
       break;
     }
 
+    else if(cmd == "rs"sv || cmd == "reverse-step"sv) {
+      if(can_reverse() && rec->reverse_step()) return true;
+    }
+
+    else if(cmd == "rc"sv || cmd == "reverse-continue"sv) {
+      if(can_reverse() && rec->reverse_continue()) return true;
+    }
+
     else std::cerr << "unknown debugger command: " << cmd << '\n';
   }
+  return false;
 }
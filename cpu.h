@@ -2,45 +2,302 @@
 #ifndef CPU_H_
 #define CPU_H_
 #include <vector>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <istream>
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <cstdlib>
 
 #define REGS r0, r1, r2, r3, r4, r5, r6, r7
 #define REGS_PARAMS \
   std::uint32_t r0, std::uint32_t r1, std::uint32_t r2, std::uint32_t r3, \
     std::uint32_t r4, std::uint32_t r5, std::uint32_t r6, std::uint32_t r7
 
+/* The architectural state of a CPU between instructions. */
+struct cpu_state {
+  std::uint32_t pc;
+  std::array<std::uint32_t, 8> regs;
+  bool Z, N, cmp;
+
+  bool operator==(const cpu_state&) const = default;
+};
+
+/* Receives events from the instrumented engine: the state on entering each
+   block (including the first), and then, if asked for on entering the block,
+   each instruction fetched and each load and store the guest makes, with the
+   value (zero-extended) and size in bytes, stores being reported before they
+   are made.  An observer of blocks only is also told about the blocks entered
+   in the uninstrumented engine. */
+class observer {
+public:
+  enum events : unsigned { instructions = 1, accesses = 2 };
+
+  virtual ~observer() {}
+
+  /* Returns the events wanted until the end of the block. */
+  virtual unsigned block(const cpu_state&) { return 0; }
+  virtual void instruction(std::uint32_t, std::uint32_t) {}
+  virtual void load(std::uint32_t, std::uint32_t, unsigned) {}
+  virtual void store(std::uint32_t, std::uint32_t, unsigned) {}
+};
+
+/* Passes events on to several observers in turn. */
+class observers final : public observer {
+  std::vector<observer*> list;
+
+public:
+  void add(observer& o) { list.push_back(&o); }
+
+private:
+  unsigned block(const cpu_state& state) override {
+    unsigned res = 0;
+    for(observer * o : list) res |= o->block(state);
+    return res;
+  }
+
+  void instruction(std::uint32_t pc, std::uint32_t inst) override {
+    for(observer * o : list) o->instruction(pc, inst);
+  }
+
+  void load(std::uint32_t addr, std::uint32_t value, unsigned size) override {
+    for(observer * o : list) o->load(addr, value, size);
+  }
+
+  void store(std::uint32_t addr, std::uint32_t value,
+	     unsigned size) override {
+    for(observer * o : list) o->store(addr, value, size);
+  }
+};
+
+class recorder;
+class interval_sampler;
+class scheduler;
+
 class CPU {
+  friend class recorder;
+  friend class interval_sampler;
+
+  /* A register, a constant, or the byte, halfword or word at an address given
+     by a register or a constant.  Memory is only read where a single array
+     device serves all of it, so that evaluating has no side effects; a
+     condition reading anything else does not hold. */
+  struct operand {
+    enum { reg, constant, memory } kind;
+    unsigned size;
+    bool indirect;
+    std::uint32_t value;
+  };
+
+  struct comparison {
+    operand lhs, rhs;
+    enum { eq, ne, lt, le, gt, ge } op;
+  };
+
   struct breakpoint {
     int num;
     std::uint32_t addr;
+    std::vector<comparison> condition{};
+    std::string text{};
+    std::uint64_t hits = 0;
+    std::uint64_t ignore = 0;
   };
 
+  const std::uint32_t id;
+  std::uint32_t reset_vector = 0;
   bool Z = false, N = false, cmp = false;
   std::vector<breakpoint> breakpoints;
   int next_breakpoint = 1;
+  bool instrumented = false;
+  observer * obs = nullptr;
+  std::unique_ptr<observers> fanout;
+  std::atomic<std::uint32_t> current_block{0};
+  std::uint64_t slow_accesses = 0;
+  std::uint64_t loads = 0, stores = 0, taken = 0, device_accesses = 0;
+  /* The counts for the performance counter device, in the order of
+     guest_counts. */
+  std::array<std::uint64_t, 5> counts{};
+
+  /* The loads and stores of a block from start to end inclusive. */
+  struct block_accesses {
+    std::uint32_t start = 1, end = 0;
+    std::uint32_t loads = 0, stores = 0;
+  };
+
+  /* While counting accesses, the blocks run lately, direct-mapped by start,
+     so that each block is decoded once rather than its accesses counted as
+     they are made.  Code rewritten in place keeps the counts of the code it
+     replaced for as long as its block stays cached. */
+  static constexpr std::size_t count_cache_size = 1024;
+  std::unique_ptr<block_accesses[]> count_cache;
+  static block_accesses decode_block(std::uint32_t, std::uint32_t);
 
+  [[gnu::always_inline]]
+  void count_block(std::uint32_t start, std::uint32_t end) {
+    block_accesses& b = count_cache[start >> 2 & (count_cache_size - 1)];
+    if(b.start != start || b.end != end) [[unlikely]]
+      b = decode_block(start, end);
+    loads += b.loads;
+    stores += b.stores;
+  }
+
+  void publish_counts() {
+    published_fast.store(loads + stores - slow_accesses,
+			 std::memory_order_relaxed);
+    published_slow.store(slow_accesses, std::memory_order_relaxed);
+    counts = {retired, taken, loads, stores, device_accesses};
+  }
+
+  std::atomic<std::uint64_t> published_retired{0};
+  std::atomic<std::uint64_t> published_fast{0}, published_slow{0};
+  std::atomic_bool interrupted{false};
+  bool restarting = false;
+
+  std::unique_ptr<std::istream> script;
+  bool scripted = false;
+  bool stop_at_start = false;
+
+  /* The instrumented engine counts the instructions it starts, and the
+     uninstrumented one those of each block once it ends, both leaving out an
+     invalid instruction the program stops on.  The debugger stops before
+     the one numbered stop_at.  run starts from the resume state rather than
+     the reset vector if there is one. */
+  std::uint64_t retired = 0;
+  std::uint64_t stop_at = UINT64_MAX;
+  std::optional<cpu_state> resume;
+  /* The events the observers asked for on entering the block run is to start
+     from, if an engine has already told them about it. */
+  std::optional<unsigned> entered;
+  recorder * rec = nullptr;
+  scheduler * sched = nullptr;
+
+  static std::optional<operand> parse_operand(std::string_view);
+  static std::optional<std::uint32_t>
+  evaluate(const operand&, const std::array<std::uint32_t, 8>&);
+  static bool holds(const std::vector<comparison>&,
+		    const std::array<std::uint32_t, 8>&);
   void check_breakpoint(bool&, std::uint32_t,
-			std::vector<breakpoint>::const_iterator&);
+			std::vector<breakpoint>::iterator&, REGS_PARAMS);
 
   [[gnu::always_inline]]
-  void check_breakpoints(bool& single_step, std::uint32_t pc) {
-    for(auto it = breakpoints.cbegin(); it != breakpoints.cend();) {
+  void check_breakpoints(bool& single_step, std::uint32_t pc, REGS_PARAMS) {
+    for(auto it = breakpoints.begin(); it != breakpoints.end();) {
       [[unlikely]]
-      check_breakpoint(single_step, pc, it);
+      check_breakpoint(single_step, pc, it, REGS);
     }
   }
 
-  void single_step(bool&, std::uint32_t, std::uint32_t, REGS_PARAMS);
+  /* Returns true if run has to return so that execute restarts it from the
+     resume state. */
+  bool single_step(bool&, std::uint32_t, std::uint32_t, REGS_PARAMS);
 
   [[gnu::always_inline]]
-  void maybe_single_step(bool& single_step, std::uint32_t pc,
+  bool maybe_single_step(bool& single_step, std::uint32_t pc,
 			 std::uint32_t inst, REGS_PARAMS) {
-    check_breakpoints(single_step, pc);
-    if(single_step) this->single_step(single_step, pc, inst, REGS);
+    check_breakpoints(single_step, pc, REGS);
+    return single_step && this->single_step(single_step, pc, inst, REGS);
   }
 
+  /* The engine accesses memory through the fastmem window if direct. */
+  template<bool instrumented, bool direct = false> void run();
+
 public:
+  explicit CPU(std::uint32_t id = 0) : id{id} {}
+  CPU(const CPU&) = delete;
+  CPU& operator=(const CPU&) = delete;
+
+  void set_reset_vector(std::uint32_t pc) {
+    reset_vector = pc;
+    current_block.store(pc, std::memory_order_relaxed);
+  }
+
   void add_breakpoint(std::uint32_t);
+
+  /* Parses "ADDR [if OPERAND OP OPERAND [&& ...]]", returning false if it is
+     malformed. */
+  bool add_breakpoint(std::string_view);
+
+  /* Reads debugger commands from the stream, stopping before the first
+     instruction to do so.  Once the script ends, the debugger prompts if
+     stdin is a terminal and otherwise keeps running. */
+  void debug_script(std::unique_ptr<std::istream>);
+
+  /* Counts loads and stores, and accesses through the device table, for the
+     performance counters and introspection.  Either engine counts them a
+     block at a time, at the cost of a lookup as each block ends. */
+  void count_accesses() {
+    count_cache = std::make_unique<block_accesses[]>(count_cache_size);
+  }
+
+  /* Reports events from the instrumented engine to the observer, in addition
+     to any already added. */
+  void observe(observer&);
+
+  /* Like observe, except that the CPU is only instrumented for the blocks
+     the observers ask events for on entering them.  The others run in the
+     uninstrumented engine, at the cost of telling the observers about each
+     as it is entered. */
+  void observe_blocks(observer&);
+
+  /* Lets the debugger go back through the recorder, which observes the
+     CPU. */
+  void record(recorder&);
+
+  /* Advances the scheduler to the instructions run at the end of each
+     block, and gives it that count as its guest time. */
+  void drive(scheduler&);
+
+  /* The start of the block the CPU is running, as published by either engine
+     as it enters each block. */
+  std::uint32_t get_current_block() const {
+    return current_block.load(std::memory_order_relaxed);
+  }
+
+  /* The instructions started and the loads and stores made through the
+     largest devices' contents and through the device table, as published at
+     the end of each block.  Accesses are counted only once count_accesses
+     has been called. */
+  std::uint64_t get_retired() const {
+    return published_retired.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t get_fast_accesses() const {
+    return published_fast.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t get_slow_accesses() const {
+    return published_slow.load(std::memory_order_relaxed);
+  }
+
+  /* Set once the process starts exiting, so that only the first CPU to exit
+     runs the exit handlers. */
+  static std::atomic_bool exiting;
+
+  /* Exits with the status, or returns for the CPU to stop if the process is
+     already exiting. */
+  static void halt(int status) {
+    if(!exiting.exchange(true)) std::exit(status);
+  }
+
+  /* Makes execute return at the end of the current block. */
+  void interrupt() { interrupted.store(true, std::memory_order_relaxed); }
+
+  /* Makes execute carry on from the end of the current block in the engine
+     it would now pick, as after starting to observe the CPU from the
+     scheduler.  Only for the thread running the CPU. */
+  void restart() {
+    restarting = true;
+    interrupt();
+  }
+
+  /* Runs until entering the block at the address, which must not be the
+     reset vector, so that execute carries on from there.  Observers are not
+     told about these instructions. */
+  void run_to(std::uint32_t);
+
   void execute();
 };
 
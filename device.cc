@@ -2,12 +2,29 @@
 #include "device.h"
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <string>
+#include <map>
+#include <tuple>
 #include <utility>
+#include <algorithm>
+#include <bit>
+#include <typeinfo>
 #include <cstdio>
+#include <cerrno>
+#include <climits>
 #include <cassert>
 
 using std::uint32_t;
@@ -63,47 +80,137 @@ device::device(uint32_t base, uint32_t lim) : base{base}, lim{lim} {
 }
 
 array_device * largest_readable = nullptr;
+bool backed_memory = false;
+
+/* The descriptors backing contents mapped for devices still being
+   constructed, by the address of the contents. */
+static std::map<const void*, std::pair<int, std::uint64_t>> backings;
+
+static void note_backing(const void * contents, int fd, std::uint64_t off) {
+  backings[contents] = {fd, off};
+}
 
 array_device::array_device(uint32_t * contents, uint32_t base, uint32_t lim)
   : device{base, lim}, contents{contents} {
+  array = true;
   if(!largest_readable || lim > largest_readable->get_limit())
     largest_readable = this;
+  if(const auto it = backings.find(contents); it != backings.end()) {
+    std::tie(backing, backing_offset) = it->second;
+    backings.erase(it);
+  }
 }
 
-void array_device::shadow_ROM(uint32_t off, int fd, uint32_t lim) {
+/* Only the private contents of plain memory can have their pages replaced
+   by mappings without being lost to anyone else mapping them. */
+bool array_device::pages_replaceable() {
+  return backing == -1 && typeid(*this) == typeid(memory);
+}
+
+void array_device::shadow_ROM(uint32_t off, int fd, uint32_t lim,
+			      std::uint64_t pos) {
   assert(std::uint64_t{off} + lim <= get_limit());
-  char * cur = get_offset(contents, off);
-  std::size_t left = std::size_t{lim} + 1;
-  ssize_t nread;
-  while((nread = read(fd, cur, left)) > 0) {
-    cur += nread;
-    left -= nread;
-  }
-  if(nread == -1) {
-    std::perror("cannot read ROM");
+  char * const dest = get_offset(contents, off);
+  std::size_t size = std::size_t{lim} + 1;
+  struct stat st;
+  if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    size = static_cast<std::uint64_t>(st.st_size) > pos
+      ? std::min<std::uint64_t>(size, st.st_size - pos) : 0;
+  // The whole pages from first to last, if the file lines up with them.
+  const std::size_t ps = sysconf(_SC_PAGESIZE);
+  const std::size_t first =
+    (ps - reinterpret_cast<std::uintptr_t>(dest) % ps) % ps;
+  std::size_t last = first;
+  if(pages_replaceable() && size > first
+     && (pos + first) % ps == 0 && S_ISREG(st.st_mode)) {
+    last = first + (size - first) / ps * ps;
+    if(last > first
+       && mmap(dest + first, last - first, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_FIXED, fd, pos + first) == MAP_FAILED)
+      last = first;
+  }
+  const auto copy = [&](std::size_t from, std::size_t to) {
+    while(from < to) {
+      const ssize_t nread = pread(fd, dest + from, to - from, pos + from);
+      if(nread == -1) {
+	std::perror("cannot read ROM");
+	std::exit(-3);
+      }
+      if(nread == 0) break;
+      from += nread;
+    }
+  };
+  copy(0, std::min(first, size));
+  copy(last, size);
+}
+
+void array_device::zero(uint32_t off, uint32_t lim) {
+  assert(std::uint64_t{off} + lim <= get_limit());
+  char * const dest = get_offset(contents, off);
+  const std::size_t size = std::size_t{lim} + 1;
+  const std::size_t ps = sysconf(_SC_PAGESIZE);
+  std::size_t first =
+    std::min(size, (ps - reinterpret_cast<std::uintptr_t>(dest) % ps) % ps);
+  std::size_t last = first + (size - first) / ps * ps;
+  if(!pages_replaceable() || last == first
+     || mmap(dest + first, last - first, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS, -1, 0) == MAP_FAILED)
+    first = last = size;
+  std::memset(dest, 0, first);
+  std::memset(dest + last, 0, size - last);
+}
+
+/* Rounds the limit of a writable array device up to the end of a page. */
+static void round_limit(uint32_t& lim) {
+  if(lim >= UINT32_MAX - 3 && UINT32_MAX == SIZE_MAX)
+    throw std::bad_alloc();
+  const uint32_t ps = static_cast<uint32_t>(sysconf(_SC_PAGESIZE));
+  lim = ((lim + ps) & ~(ps - 1)) - 1;
+}
+
+/* Allocates zeroed, page-aligned contents for a writable array device,
+   rounding the limit up to the end of a page. */
+static uint32_t * allocate_contents(uint32_t& lim) {
+  round_limit(lim);
+  const long pagesize = sysconf(_SC_PAGESIZE);
+  const std::align_val_t align = static_cast<std::align_val_t>(pagesize);
+  const size_t size = (static_cast<size_t>(lim) + 4) >> 2;
+  uint32_t * const contents =
+    /* On byte-addressable machines, we allocate a character array to
+       allow unaligned access (using memcpy) without undefined behaviour.
+       On other machines, we allocate a uint32_t array to save space. */
+    sizeof(uint32_t) == 4
+    ? reinterpret_cast<uint32_t*>(new(align) char[lim + 1])
+    : new(align) uint32_t[size];
+  std::memset(contents, 0, lim + 1);
+  return contents;
+}
+
+/* Maps zeroed contents from a new memory file, noting it as their backing. */
+static char * allocate_backed(std::size_t size, const char * what) {
+  const int fd = memfd_create(what, MFD_CLOEXEC);
+  void * ptr = MAP_FAILED;
+  if(fd != -1 && ftruncate(fd, size) == 0)
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(ptr == MAP_FAILED) {
+    std::cerr << "cannot allocate " << what << ": ";
+    std::perror("");
     std::exit(-3);
   }
+  note_backing(ptr, fd, 0);
+  return static_cast<char*>(ptr);
 }
 
 memory::memory(uint32_t base, uint32_t lim)
-  : array_device{[&]() {
-    if(lim >= UINT32_MAX - 3 && UINT32_MAX == SIZE_MAX)
-      throw std::bad_alloc();
-    const long pagesize = sysconf(_SC_PAGESIZE);
-    const std::align_val_t align = static_cast<std::align_val_t>(pagesize);
-    const uint32_t ps = static_cast<uint32_t>(pagesize);
-    lim = ((lim + ps) & ~ps) - 1;
-    const size_t size = (static_cast<size_t>(lim) + 4) >> 2;
-    uint32_t * const contents =
-      /* On byte-addressable machines, we allocate a character array to
-	 allow unaligned access (using memcpy) without undefined behaviour.
-	 On other machines, we allocate a uint32_t array to save space. */
-      sizeof(uint32_t) == 4
-      ? reinterpret_cast<uint32_t*>(new(align) char[lim + 1])
-      : new(align) uint32_t[size];
-    std::memset(contents, 0, lim + 1);
-    return contents;
-  }(), base, lim} {
+  : memory{[&]() {
+    if(!backed_memory) return allocate_contents(lim);
+    round_limit(lim);
+    return reinterpret_cast<uint32_t*>
+      (allocate_backed(std::size_t{lim} + 1, "memory"));
+  }(), base, lim} {}
+
+memory::memory(uint32_t * contents, uint32_t base, uint32_t lim)
+  : array_device{contents, base, lim} {
   if(lim > 0xFFFFFFFB)
     throw std::domain_error{"limit too large"};
   if(!largest_memory || lim > largest_memory->get_limit())
@@ -112,6 +219,36 @@ memory::memory(uint32_t base, uint32_t lim)
 
 memory * largest_memory = nullptr;
 
+static std::size_t page_round(uint32_t lim) {
+  const std::size_t pagesize = sysconf(_SC_PAGESIZE);
+  return (std::size_t{lim} + pagesize) & ~(pagesize - 1);
+}
+
+shared_memory::shared_memory(const char * name, uint32_t base, uint32_t lim)
+  : memory{[&]() {
+    const std::size_t size = page_round(lim) + sysconf(_SC_PAGESIZE);
+    const int fd = shm_open(name, O_RDWR | O_CREAT, 0666);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1
+       || (static_cast<std::size_t>(st.st_size) < size
+	   && ftruncate(fd, size) == -1)) {
+      std::cerr << "cannot open shared memory " << name << ": ";
+      std::perror("");
+      std::exit(-3);
+    }
+    const auto ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  fd, 0);
+    if(ptr == MAP_FAILED) {
+      std::perror("cannot map shared memory");
+      std::exit(-3);
+    }
+    if(backed_memory) note_backing(ptr, fd, 0);
+    else close(fd);
+    return static_cast<uint32_t*>(ptr);
+  }(), base, lim},
+    bells{reinterpret_cast<std::atomic<uint32_t>*>
+	  (get_offset(get_contents(), page_round(lim)))} {}
+
 mmap_device::mmap_device(int fd, uint32_t base, uint32_t limit)
   : array_device{[&]() {
     uint32_t * contents = NULL;
@@ -120,29 +257,282 @@ mmap_device::mmap_device(int fd, uint32_t base, uint32_t limit)
       std::perror("cannot map ROM");
       std::exit(-3);
     }
+    if(backed_memory) note_backing(ptr, fcntl(fd, F_DUPFD_CLOEXEC, 0), 0);
     return contents;
   }(), base, limit} {}
 
 mmap_ROM::mmap_ROM(int fd, uint32_t base, uint32_t limit)
   : read_only_device{fd, base, limit} {}
 
-void stdio::reader() {
-  while(true) {
-    input = std::cin.get();
-    input_ready.wait(input_ready = true);
+segment_device::segment_device(int fd, std::uint64_t offset, uint32_t size,
+			       uint32_t base, uint32_t limit)
+  : array_device{[&]() {
+    const std::uint64_t pagesize = sysconf(_SC_PAGESIZE);
+    const std::uint64_t delta = offset % pagesize;
+    const std::size_t total = delta + limit + 1;
+    if(backed_memory) {
+      // The segment is read in, as a private mapping cannot be shared.
+      char * const map = allocate_backed(total, "segment");
+      for(std::size_t done = 0; done < size;) {
+	const ssize_t nread =
+	  pread(fd, map + delta + done, size - done, offset + done);
+	if(nread <= 0) {
+	  std::perror("cannot read segment");
+	  std::exit(-3);
+	}
+	done += nread;
+      }
+      note_backing(map + delta, backings[map].first, delta);
+      backings.erase(map);
+      return reinterpret_cast<uint32_t*>(map + delta);
+    }
+    char * const map = static_cast<char*>
+      (mmap(NULL, total, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if(map == MAP_FAILED) {
+      std::perror("cannot map segment");
+      std::exit(-3);
+    }
+    if(size > 0) {
+      const std::size_t file_end = delta + size;
+      if(mmap(map, file_end, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	      fd, offset - delta) == MAP_FAILED) {
+	std::perror("cannot map segment");
+	std::exit(-3);
+      }
+      const std::size_t page_end =
+	std::min<std::size_t>((file_end + pagesize - 1) & ~(pagesize - 1),
+			      total);
+      std::memset(map + file_end, 0, page_end - file_end);
+    }
+    return reinterpret_cast<uint32_t*>(map + delta);
+  }(), base, limit} {}
+
+segment_ROM::segment_ROM(int fd, std::uint64_t offset, uint32_t size,
+			 uint32_t base, uint32_t limit)
+  : read_only_device{fd, offset, size, base, limit} {}
+
+reactor::reactor() : epfd{epoll_create1(EPOLL_CLOEXEC)} {
+  if(epfd == -1) {
+    std::perror("cannot create epoll instance");
+    std::exit(-3);
   }
+  std::thread{&reactor::run, this}.detach();
 }
 
-void stdio::writer() {
+reactor& reactor::instance() {
+  static reactor the;
+  return the;
+}
+
+void reactor::run() {
+  std::array<epoll_event, 64> events;
   while(true) {
-    output_finished.wait(true);
-    std::cout.put(output);
-    output_finished = true;
+    const int n = epoll_wait(epfd, events.data(), events.size(), -1);
+    if(n == -1 && errno != EINTR) {
+      std::perror("cannot wait for host I/O");
+      std::exit(-3);
+    }
+    for(int i = 0; i < n; i++)
+      (*static_cast<handler*>(events[i].data.ptr))(events[i].events);
+  }
+}
+
+bool reactor::watch(int fd, uint32_t events, handler& h) {
+  epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = &h;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0) return true;
+  if(errno == EPERM) return false;
+  std::perror("cannot watch host file");
+  std::exit(-3);
+}
+
+void reactor::rewatch(int fd, uint32_t events, handler& h) {
+  epoll_event ev;
+  ev.events = events;
+  ev.data.ptr = &h;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void reactor::unwatch(int fd) {
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+/* Output is written out once this much has gathered, or after the latency
+   otherwise, and in pieces of at most this much when the descriptor is
+   polled, so that a blocking descriptor reported writable does not block. */
+static constexpr std::size_t flush_size = 4096;
+static constexpr long flush_latency_ns = 1000000;
+
+std::vector<uart*> uart::started;
+
+void uart::flush_started() {
+  for(uart * dev : started) dev->flush();
+}
+
+static std::atomic_bool released{false};
+
+void release_devices() {
+  released.store(true);
+  uart::flush_started();
+}
+
+uart::uart(uint32_t base, int in_fd, int out_fd, bool start_now)
+  : device{base, 7}, in_fd{in_fd},
+    out_fd{out_fd == in_fd ? fcntl(out_fd, F_DUPFD_CLOEXEC, 0) : out_fd} {
+  if(start_now) start();
+}
+
+void uart::start() {
+  struct stat st;
+  if(fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    const off_t pos = lseek(in_fd, 0, SEEK_CUR);
+    mapped_size = st.st_size;
+    mapped_pos = pos > 0 ? std::min<std::size_t>(pos, mapped_size) : 0;
+    if(mapped_size > 0) {
+      const auto ptr =
+	mmap(NULL, mapped_size, PROT_READ, MAP_PRIVATE, in_fd, 0);
+      if(ptr != MAP_FAILED) {
+	posix_madvise(ptr, mapped_size, POSIX_MADV_SEQUENTIAL);
+	mapped = static_cast<const char*>(ptr);
+      }
+    }
+    input_mapped = mapped || mapped_size == 0;
+  }
+  kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if(kick_fd == -1 || timer_fd == -1) {
+    std::perror("cannot create serial line events");
+    std::exit(-3);
+  }
+  on_input = [this](uint32_t) { fill(); };
+  on_output = [this](uint32_t) {
+    const std::lock_guard lock{flushing};
+    write_out(flush_size);
+    if(output.size() == 0) reactor::instance().rewatch(out_fd, 0, on_output);
+  };
+  on_kick = [this](uint32_t) {
+    std::uint64_t count;
+    [[maybe_unused]] const auto res = read(kick_fd, &count, sizeof(count));
+    if(input_paused && !input.full()) {
+      input_paused = false;
+      reactor::instance().rewatch(in_fd, EPOLLIN, on_input);
+    }
+    if(output.size() >= flush_size) drain();
+    else if(output.size() > 0 && !timer_armed) {
+      itimerspec spec{};
+      spec.it_value.tv_nsec = flush_latency_ns;
+      timerfd_settime(timer_fd, 0, &spec, NULL);
+      timer_armed = true;
+    }
+  };
+  on_timer = [this](uint32_t) {
+    std::uint64_t count;
+    [[maybe_unused]] const auto res = read(timer_fd, &count, sizeof(count));
+    timer_armed = false;
+    drain();
+  };
+  reactor& r = reactor::instance();
+  if(!input_mapped && !r.watch(in_fd, EPOLLIN, on_input))
+    input_ended = true;
+  out_polled = r.watch(out_fd, 0, on_output);
+  r.watch(kick_fd, EPOLLIN, on_kick);
+  r.watch(timer_fd, EPOLLIN, on_timer);
+  if(started.empty()) std::atexit(flush_started);
+  started.push_back(this);
+}
+
+void uart::kick() {
+  const std::uint64_t one = 1;
+  [[maybe_unused]] const auto res = write(kick_fd, &one, sizeof(one));
+}
+
+/* Runs on the reactor thread when there is input to read. */
+void uart::fill() {
+  if(input.full()) {
+    input_paused = true;
+    reactor::instance().rewatch(in_fd, 0, on_input);
+    // The guest may have made room before seeing the pause.
+    if(!input.full()) kick();
+    return;
+  }
+  const auto space = input.space();
+  const ssize_t nread = read(in_fd, space.data(), space.size());
+  if(nread > 0) input.produce(nread);
+  else if(nread == 0 || (errno != EINTR && errno != EAGAIN)) {
+    input_ended.store(true, std::memory_order_release);
+    reactor::instance().unwatch(in_fd);
+  }
+}
+
+/* Runs on the reactor thread when output is due. */
+void uart::drain() {
+  if(out_polled) reactor::instance().rewatch(out_fd, EPOLLOUT, on_output);
+  else {
+    const std::lock_guard lock{flushing};
+    while(output.size() > 0 && write_out(SIZE_MAX));
+  }
+}
+
+/* Writes out up to the limit, returning false if nothing could be written
+   now.  Output that cannot be written at all is dropped. */
+bool uart::write_out(std::size_t limit) {
+  const auto spans = output.contents();
+  iovec iov[2];
+  for(int i = 0; i < 2; i++) {
+    const std::size_t len = std::min(spans[i].size(), limit);
+    iov[i].iov_base = const_cast<char*>(spans[i].data());
+    iov[i].iov_len = len;
+    limit -= len;
+  }
+  const ssize_t written = writev(out_fd, iov, iov[1].iov_len ? 2 : 1);
+  if(written > 0) output.consume(written);
+  else if(written == 0 || (errno != EINTR && errno != EAGAIN))
+    output.consume(output.size());
+  else return false;
+  return true;
+}
+
+void uart::flush() {
+  const std::lock_guard lock{flushing};
+  while(output.size() > 0)
+    if(!write_out(SIZE_MAX)) {
+      pollfd pfd = { out_fd, POLLOUT, 0 };
+      poll(&pfd, 1, 100);
+    }
+}
+
+/* Returns the next input byte, or -1 if there is none yet and -2 at the end
+   of the input. */
+int uart::next_input() {
+  if(input_mapped)
+    return mapped_pos < mapped_size
+      ? static_cast<uint8_t>(mapped[mapped_pos]) : -2;
+  // Once the input has ended, all of it is in the ring.
+  const bool ended = input_ended.load(std::memory_order_acquire);
+  if(input.size() > 0) return static_cast<uint8_t>(input.front());
+  return ended ? -2 : -1;
+}
+
+uint8_t uart::iget_byte(uint32_t off, int next) {
+  switch(off) {
+  case 0:
+    return next >= 0 ? next : next == -2 ? 0xFF : 0;
+  case 1:
+    return next == -1 ? 0 : (next == -2) << 1 | 1;
+  case 4:
+    return !output.full();
+  default:
+    return 0;
   }
 }
 
-stdio::stdio(uint32_t base)
-  : device{base, 7}, output_finished{true}, input_ready{false} {
+stdio::stdio(uint32_t base, bool start_now) : uart{base, 0, 1, false} {
+  if(start_now) start();
+}
+
+void stdio::start() {
   if(isatty(0)) {
     std::setbuf(stdin, NULL);
     std::setbuf(stdout, NULL);
@@ -156,45 +546,74 @@ stdio::stdio(uint32_t base)
     termios.c_cc[VTIME] = 0;
     tcsetattr(0, TCSANOW, &termios);
   }
-  new std::thread(&stdio::reader, this);
-  new std::thread(&stdio::writer, this);
+  uart::start();
 }
 
-uint8_t stdio::iget_byte(uint32_t off, bool input_ready) {
-  switch(off) {
-  case 0:
-    return input_ready ? input : 0;
-  case 1:
-    return input_ready ? (uint8_t)std::cin.eof() << 1 | 1 : 0;
-  case 4:
-    return output_finished;
-  default:
-    return 0;
+input_log * inputs = nullptr;
+
+input_log::input_log(std::FILE * replay, std::FILE * file) : file{file} {
+  if(replay) {
+    unsigned char bytes[4];
+    while(std::fread(bytes, 1, 4, replay) == 4)
+      values.push_back(bytes[0] | bytes[1] << 8 | bytes[2] << 16
+		       | static_cast<uint32_t>(bytes[3]) << 24);
+    if(std::ferror(replay)) {
+      std::perror("cannot read input log");
+      std::exit(-3);
+    }
   }
+  if(file)
+    for(const uint32_t value : values) {
+      const unsigned char bytes[4] = {
+	static_cast<unsigned char>(value),
+	static_cast<unsigned char>(value >> 8),
+	static_cast<unsigned char>(value >> 16),
+	static_cast<unsigned char>(value >> 24)
+      };
+      std::fwrite(bytes, 1, 4, file);
+    }
 }
 
-uint8_t stdio::get_byte_impl(uint32_t off) {
-  return iget_byte(off, input_ready);
+/* Reads a nondeterministic value through the input log, if there is one. */
+template<typename T, typename F> static T logged(F&& host) {
+  if(inputs) return inputs->read<T>(host);
+  return host();
 }
 
-void stdio::set_byte_impl(uint32_t off, uint8_t byte) {
-  if(off == 4 && output_finished) {
-    output = byte;
-    output_finished = false;
-    output_finished.notify_one();
+uint8_t uart::get_byte_impl(uint32_t off) {
+  return logged<uint8_t>([&]() { return iget_byte(off, next_input()); });
+}
+
+void uart::set_byte_impl(uint32_t off, uint8_t byte) {
+  if(off != 4) return;
+  if(inputs) {
+    if(inputs->reexecuting()) return;
+    // The log may say there is room before the reactor has made it.
+    if(output.full() && !released.load()) output.wait_for_space();
   }
+  if(output.full()) return;
+  output.push(byte);
+  const std::size_t queued = output.size();
+  if(queued == 1 || queued == flush_size) kick();
+}
+
+uint32_t uart::get_word_impl(uint32_t off) {
+  return logged<uint32_t>([&]() { return iget_word(off); });
 }
 
-uint32_t stdio::get_word_impl(uint32_t off) {
+uint32_t uart::iget_word(uint32_t off) {
   uint32_t res = 0;
-  bool input_ready = this->input_ready;
-  res |= iget_byte(off, input_ready);
-  res |= iget_byte(off + 1, input_ready) << 8;
-  res |= iget_byte(off + 2, input_ready) << 16;
-  res |= iget_byte(off + 3, input_ready) << 24;
-  if((off >= (uint32_t)-3 || off == 0) && input_ready) {
-    this->input_ready = false;
-    this->input_ready.notify_one();
+  const int next = next_input();
+  res |= iget_byte(off, next);
+  res |= iget_byte(off + 1, next) << 8;
+  res |= iget_byte(off + 2, next) << 16;
+  res |= iget_byte(off + 3, next) << 24;
+  if((off >= (uint32_t)-3 || off == 0) && next >= 0) {
+    if(input_mapped) mapped_pos++;
+    else {
+      input.consume(1);
+      if(input_paused) kick();
+    }
   }
   return res;
 }
@@ -203,9 +622,11 @@ ticks::ticks(uint32_t base) : read_only_device{base, 3} {}
 
 uint32_t ticks::get_word_impl(uint32_t off) {
   if((off & 3) == 0) {
-    return static_cast<uint32_t>
-      (std::chrono::duration_cast<std::chrono::milliseconds>
-       (std::chrono::steady_clock::now().time_since_epoch()).count());
+    return logged<uint32_t>([]() {
+      return static_cast<uint32_t>
+	(std::chrono::duration_cast<std::chrono::milliseconds>
+	 (std::chrono::steady_clock::now().time_since_epoch()).count());
+    });
   }
   const uint32_t bits = (off & 3)*8;
   return get_word_impl(0) << (32 - bits) | get_word_impl(0) >> bits;
@@ -218,3 +639,550 @@ uint8_t ticks::get_byte_impl(uint32_t off) {
 uint8_t zero_device::get_byte_impl(uint32_t) {
   return 0;
 }
+
+framebuffer::framebuffer(uint32_t base, uint32_t width, uint32_t height,
+			 int fd, bool ppm, unsigned fps)
+  : array_device{[&]() {
+    uint32_t lim = width*height*4 + 15;
+    return allocate_contents(lim);
+  }(), base, width*height*4 + 15},
+    width{width}, height{height}, tiles_x{(width + tile - 1)/tile},
+    tiles_y{(height + tile - 1)/tile}, dirty((tiles_x*tiles_y + 63)/64),
+    fd{fd}, ppm{ppm} {
+  // The first frame is complete.
+  for(auto& bits : dirty) bits = ~std::uint64_t{0};
+  if(ppm) frame.resize(std::size_t{width}*height*3);
+  set_alignedl(get_contents(), get_limit(), registers(), width);
+  set_alignedl(get_contents(), get_limit(), registers() + 4, height);
+  set_alignedl(get_contents(), get_limit(), registers() + 12, 1);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if(timer_fd == -1) {
+    std::perror("cannot create frame timer");
+    std::exit(-3);
+  }
+  const long period = 1000000000L / std::max(fps, 1u);
+  itimerspec spec;
+  spec.it_interval.tv_sec = period / 1000000000L;
+  spec.it_interval.tv_nsec = period % 1000000000L;
+  spec.it_value = spec.it_interval;
+  timerfd_settime(timer_fd, 0, &spec, NULL);
+  on_frame = [this](uint32_t) { encode(); };
+  reactor::instance().watch(timer_fd, EPOLLIN, on_frame);
+}
+
+void framebuffer::mark(uint32_t off) {
+  const uint32_t pixel = off/4;
+  const uint32_t t = pixel/width/tile*tiles_x + pixel%width/tile;
+  dirty[t/64].fetch_or(std::uint64_t{1} << t%64, std::memory_order_release);
+}
+
+void framebuffer::set_word_impl(uint32_t off, uint32_t word) {
+  if((off & 3) == 0 && off < registers()) {
+    set_word_raw(get_contents(), get_limit(), off, word);
+    mark(off);
+  }
+  else for(uint32_t i = 0; i < 4; i++)
+    if(off + i <= get_limit()) set_byte_impl(off + i, word >> i*8 & 0xFF);
+}
+
+void framebuffer::set_byte_impl(uint32_t off, uint8_t byte) {
+  // Only the control register is writable.
+  if(off >= registers() && off < registers() + 12) return;
+  const uint32_t bstart = (off & 3)*8;
+  set_alignedl(get_contents(), get_limit(), off,
+	       ((get_alignedl(get_contents(), get_limit(), off)
+		 & ~(0xFF << bstart)) | uint32_t{byte} << bstart));
+  if(off < registers()) mark(off);
+}
+
+/* Writes the tiles changed since the last frame, returning whether there were
+   any. */
+bool framebuffer::output(uint32_t number) {
+  std::vector<uint32_t> tiles;
+  for(std::size_t i = 0; i < dirty.size(); i++)
+    for(std::uint64_t bits = dirty[i].exchange(0, std::memory_order_acquire);
+	bits; bits &= bits - 1) {
+      const uint32_t t = i*64 + std::countr_zero(bits);
+      if(t < tiles_x*tiles_y) tiles.push_back(t);
+    }
+  if(tiles.empty()) return false;
+  std::string out;
+  const auto put = [&](uint32_t value, int bytes) {
+    for(int i = 0; i < bytes; i++) out.push_back(value >> i*8 & 0xFF);
+  };
+  if(!ppm) {
+    put(number, 4);
+    put(tiles.size(), 4);
+  }
+  for(const uint32_t t : tiles) {
+    const uint32_t x = t%tiles_x*tile;
+    const uint32_t y = t/tiles_x*tile;
+    const uint32_t w = std::min(tile, width - x);
+    const uint32_t h = std::min(tile, height - y);
+    if(!ppm) {
+      put(x, 2);
+      put(y, 2);
+      put(w, 2);
+      put(h, 2);
+    }
+    for(uint32_t row = y; row < y + h; row++) {
+      const uint32_t off = (row*width + x)*4;
+      if(!ppm) {
+	out.append(get_offset(get_contents(), off), w*4);
+	continue;
+      }
+      unsigned char * rgb = &frame[(std::size_t{row}*width + x)*3];
+      for(uint32_t i = 0; i < w; i++) {
+	const uint32_t pixel = get_word_raw(get_contents(), get_limit(),
+					    off + i*4);
+	*rgb++ = pixel >> 16 & 0xFF;
+	*rgb++ = pixel >> 8 & 0xFF;
+	*rgb++ = pixel & 0xFF;
+      }
+    }
+  }
+  if(ppm) {
+    out = "P6\n" + std::to_string(width) + ' ' + std::to_string(height)
+      + "\n255\n";
+    out.append(reinterpret_cast<const char*>(frame.data()), frame.size());
+  }
+  for(std::size_t done = 0; done < out.size();) {
+    const ssize_t res = write(fd, out.data() + done, out.size() - done);
+    if(res == -1 && errno == EINTR) continue;
+    if(res == -1) {
+      std::perror("cannot write frame");
+      std::exit(-3);
+    }
+    done += res;
+  }
+  return true;
+}
+
+/* Runs on the reactor thread when a frame is due.  Frames missed while the
+   previous one was written are skipped. */
+void framebuffer::encode() {
+  std::uint64_t expirations;
+  if(read(timer_fd, &expirations, sizeof(expirations)) <= 0) return;
+  if(!(get_alignedl(get_contents(), get_limit(), registers() + 12) & 1))
+    return;
+  if(output(frames))
+    set_alignedl(get_contents(), get_limit(), registers() + 8, ++frames);
+}
+
+static bool owns_range(device * dev, uint32_t addr, uint32_t len) {
+  const std::uint64_t end = std::uint64_t{addr} + len;
+  for(std::uint64_t cur = addr; cur < end;) {
+    const auto step = std::visit([&](const auto& val3) -> std::uint64_t {
+      if constexpr(std::is_same_v<decltype(val3), device* const&>)
+	return val3 == dev ? std::uint64_t{1} << 22 : 0;
+      else return std::visit([&](const auto& val2) -> std::uint64_t {
+	if constexpr(std::is_same_v<decltype(val2), device* const&>)
+	  return val2 == dev ? std::uint64_t{1} << 12 : 0;
+	else return (*val2)[(cur >> 2) & 0x3FF] == dev ? 4 : 0;
+      }, (*val3)[(cur >> 12) & 0x3FF]);
+    }, devtab[cur >> 22]);
+    if(step == 0) return false;
+    cur = (cur & ~(step - 1)) + step;
+  }
+  return true;
+}
+
+char * host_range(uint32_t addr, uint32_t len, bool writable) {
+  device * const dev = get_device(addr);
+  const uint32_t off = addr - dev->get_base();
+  if(len == 0 || std::uint64_t{off} + len - 1 > dev->get_limit())
+    return nullptr;
+  if(writable && !dynamic_cast<memory*>(dev)) return nullptr;
+  const auto arr = dynamic_cast<array_device*>(dev);
+  if(!arr || !owns_range(dev, addr, len)) return nullptr;
+  return get_offset(arr->get_contents(), off);
+}
+
+std::vector<array_device*> checkpointed_devices() {
+  std::vector<array_device*> res;
+  const auto add = [&](device * dev) {
+    if(!dev || (!res.empty() && res.back() == dev)) return;
+    array_device * const arr = dynamic_cast<array_device*>(dev);
+    if(!dynamic_cast<memory*>(dev) && typeid(*dev) != typeid(segment_device))
+      return;
+    if(std::find(res.begin(), res.end(), arr) == res.end())
+      res.push_back(arr);
+  };
+  for(const auto& ent3 : devtab)
+    std::visit([&](const auto& val3) {
+      if constexpr(std::is_same_v<decltype(val3), device* const&>) add(val3);
+      else
+	for(const auto& ent2 : *val3)
+	  std::visit([&](const auto& val2) {
+	    if constexpr(std::is_same_v<decltype(val2), device* const&>)
+	      add(val2);
+	    else for(device * dev : *val2) add(dev);
+	  }, ent2);
+    }, ent3);
+  return res;
+}
+
+thread_local uint32_t current_cpu = 0;
+
+semaphores::semaphores(uint32_t base, uint32_t cpus)
+  : device{base, 16 + count*16 - 1}, cpus{cpus} {}
+
+uint32_t semaphores::get_word_impl(uint32_t off) {
+  if(off & 3) return 0;
+  if(off < 16) return off == 0 ? current_cpu : off == 4 ? cpus : 0;
+  auto& value = values[(off - 16) >> 4];
+  switch(off & 15) {
+  case 0:
+    return value.load();
+  case 4:
+    return value.exchange(1);
+  case 8:
+    return value.fetch_add(1);
+  default:
+    return value.fetch_sub(1);
+  }
+}
+
+void semaphores::set_word_impl(uint32_t off, uint32_t word) {
+  if(off >= 16 && (off & 3) == 0) values[(off - 16) >> 4].store(word);
+}
+
+uint8_t semaphores::get_byte_impl(uint32_t off) {
+  const uint32_t word = off < 16 ? get_word_impl(off & ~3)
+    : values[(off - 16) >> 4].load();
+  return word >> (off & 3)*8 & 0xFF;
+}
+
+void semaphores::set_byte_impl(uint32_t, uint8_t) {}
+
+static const guest_counts no_counts{};
+thread_local const guest_counts * current_counts = &no_counts;
+
+perf_counters::perf_counters(uint32_t base, uint32_t ncpus)
+  : device{base, 8 + std::tuple_size_v<guest_counts>*8 - 1}, cpus(ncpus) {}
+
+std::uint64_t perf_counters::value(cpu_counters& cpu, std::size_t i) {
+  return cpu.is_frozen ? cpu.frozen[i] : (*current_counts)[i] - cpu.base[i];
+}
+
+uint32_t perf_counters::get_word_impl(uint32_t off) {
+  if(off & 3 || current_cpu >= cpus.size()) return 0;
+  cpu_counters& cpu = cpus[current_cpu];
+  if(off < 8) return off == 0 ? cpu.is_frozen << 1 : 0;
+  const std::uint64_t count = value(cpu, (off - 8) >> 3);
+  if(off & 4) return cpu.latched;
+  cpu.latched = count >> 32;
+  return count;
+}
+
+void perf_counters::set_word_impl(uint32_t off, uint32_t word) {
+  if(off != 0 || current_cpu >= cpus.size()) return;
+  cpu_counters& cpu = cpus[current_cpu];
+  const bool freeze = word & 2;
+  if(word & 1) {
+    cpu.base = *current_counts;
+    cpu.frozen = {};
+  }
+  else if(freeze && !cpu.is_frozen)
+    for(std::size_t i = 0; i < cpu.frozen.size(); i++)
+      cpu.frozen[i] = value(cpu, i);
+  else if(!freeze && cpu.is_frozen)
+    for(std::size_t i = 0; i < cpu.base.size(); i++)
+      cpu.base[i] = (*current_counts)[i] - cpu.frozen[i];
+  cpu.is_frozen = freeze;
+}
+
+uint8_t perf_counters::get_byte_impl(uint32_t off) {
+  return get_word_impl(off & ~3) >> (off & 3)*8 & 0xFF;
+}
+
+void perf_counters::set_byte_impl(uint32_t off, uint8_t byte) {
+  if(off == 0) set_word_impl(0, byte);
+}
+
+/* Waits on and wakes a futex that may be shared with other processes, so
+   these do not use the private futexes behind std::atomic::wait. */
+static void futex_wait(std::atomic<uint32_t> * addr, uint32_t val,
+		       const timespec * timeout = NULL) {
+  syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> * addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+doorbell::doorbell(uint32_t base, shared_memory& mem)
+  : device{base, 11}, bells{mem.get_bells()} {}
+
+uint32_t doorbell::get_word_impl(uint32_t off) {
+  if(off != 8)
+    return get_byte(off) | get_byte(off + 1) << 8 | get_byte(off + 2) << 16
+      | get_byte(off + 3) << 24;
+  // Nothing wakes the wait on exit, so it looks now and then.
+  static constexpr timespec recheck{0, 10000000};
+  uint32_t last = seen.load();
+  uint32_t cur;
+  while((cur = bells[1].load()) == last && !released.load())
+    futex_wait(&bells[1], last, &recheck);
+  seen.compare_exchange_strong(last, cur);
+  return cur;
+}
+
+uint8_t doorbell::get_byte_impl(uint32_t off) {
+  const uint32_t word = off < 4 ? bells[0].load() : bells[1].load();
+  return word >> (off & 3)*8 & 0xFF;
+}
+
+void doorbell::set_byte_impl(uint32_t off, uint8_t) {
+  if(off == 0) {
+    bells[0].fetch_add(1);
+    futex_wake(&bells[0]);
+  }
+}
+
+dma::dma(uint32_t base) : command_device{base} {}
+
+static bool word_on_one_device(uint32_t addr) {
+  return get_device(addr) == get_device(addr + 3);
+}
+
+static void copy_range(uint32_t dst, uint32_t src, uint32_t len) {
+  const auto copy = [&](uint32_t i, uint32_t size) {
+    if(size == 4 && word_on_one_device(src + i) && word_on_one_device(dst + i))
+      set_word(dst + i, get_word(src + i));
+    else for(uint32_t j = 0; j < size; j++)
+      set_byte(dst + i + j, get_byte(src + i + j));
+  };
+  uint32_t i;
+  if(dst - src < len) {
+    for(i = len; i >= 4; i -= 4) copy(i - 4, 4);
+    while(i > 0) --i, copy(i, 1);
+  }
+  else {
+    for(i = 0; len - i >= 4; i += 4) copy(i, 4);
+    for(; i < len; i++) copy(i, 1);
+  }
+}
+
+uint32_t dma::command(uint32_t op) {
+  const uint32_t src = regs[0];
+  const uint32_t dst = regs[1];
+  const uint32_t len = regs[2];
+  switch(op) {
+  case 1:
+    { const char * const from = host_range(src, len, false);
+      char * const to = host_range(dst, len, true);
+      if(from && to) std::memmove(to, from, len);
+      else copy_range(dst, src, len);
+    }
+    return 0;
+  case 2:
+    if(char * const to = host_range(dst, len, true))
+      std::memset(to, src & 0xFF, len);
+    else {
+      uint32_t i;
+      const uint32_t pattern = (src & 0xFF) * 0x01010101;
+      for(i = 0; len - i >= 4; i += 4) {
+	if(word_on_one_device(dst + i)) ::set_word(dst + i, pattern);
+	else for(int j = 0; j < 4; j++) ::set_byte(dst + i + j, src & 0xFF);
+      }
+      for(; i < len; i++) ::set_byte(dst + i, src & 0xFF);
+    }
+    return 0;
+  case 3:
+    { const char * const a = host_range(src, len, false);
+      const char * const b = host_range(dst, len, false);
+      uint32_t i = 0;
+      if(a && b) {
+	if(std::memcmp(a, b, len) == 0) i = len;
+	else i = std::mismatch(a, a + len, b).first - a;
+      }
+      else {
+	for(; len - i >= 4; i += 4)
+	  if(!word_on_one_device(src + i) || !word_on_one_device(dst + i)
+	     || ::get_word(src + i) != ::get_word(dst + i)) break;
+	while(i < len && ::get_byte(src + i) == ::get_byte(dst + i)) i++;
+      }
+      return i;
+    }
+  default:
+    return 0xFFFFFFFF;
+  }
+}
+
+host_files::host_files(uint32_t base, scheduler * sched)
+  : command_device{base}, sched{sched} {}
+
+int host_files::get_file() {
+  return regs[4] < files.size() ? files[regs[4]].fd : -1;
+}
+
+std::uint64_t host_files::get_position() {
+  return std::uint64_t{regs[3]} << 32 | regs[2];
+}
+
+void host_files::set_position(std::uint64_t pos) {
+  regs[2] = pos & 0xFFFFFFFF;
+  regs[3] = pos >> 32;
+}
+
+uint32_t host_files::open(int flags) {
+  if(regs[1] >= PATH_MAX) return 0xFFFFFFFF;
+  std::string name(regs[1], 0);
+  for(uint32_t i = 0; i < regs[1]; i++) name[i] = ::get_byte(regs[0] + i);
+  const int fd = ::open(name.c_str(), flags | O_CLOEXEC, 0666);
+  if(fd == -1) return 0xFFFFFFFF;
+  const auto it = std::find_if(files.begin(), files.end(),
+			       [](const file& f) { return f.fd == -1; });
+  if(it != files.end()) {
+    it->fd = fd;
+    return it - files.begin();
+  }
+  files.emplace_back(fd);
+  return files.size() - 1;
+}
+
+uint32_t host_files::transfer(bool write) {
+  const int fd = get_file();
+  if(fd == -1) return 0xFFFFFFFF;
+  const uint32_t addr = regs[0];
+  const uint32_t len = regs[1];
+  std::uint64_t pos = get_position();
+  bool seekable = true;
+  const auto io = [&](char * buf, std::size_t size) {
+    ssize_t res;
+    for(;;) {
+      if(seekable) {
+	res = write ? pwrite(fd, buf, size, pos) : pread(fd, buf, size, pos);
+	if(res == -1 && errno == ESPIPE) {
+	  seekable = false;
+	  continue;
+	}
+      }
+      else res = write ? ::write(fd, buf, size) : read(fd, buf, size);
+      if(res != -1 || errno != EINTR) break;
+    }
+    if(res > 0) pos += res;
+    return res;
+  };
+  uint32_t done = 0;
+  if(char * const buf = host_range(addr, len, !write)) {
+    while(done < len) {
+      const ssize_t res =
+	io(buf + done, std::min<uint32_t>(len - done, 1 << 30));
+      if(res <= 0) break;
+      done += res;
+      if(!seekable && !write) break;
+    }
+  }
+  else {
+    std::array<char, 65536> bounce;
+    while(done < len) {
+      const uint32_t size = std::min<uint32_t>(len - done, bounce.size());
+      if(write)
+	for(uint32_t i = 0; i < size; i++)
+	  bounce[i] = ::get_byte(addr + done + i);
+      const ssize_t res = io(bounce.data(), size);
+      if(res <= 0) break;
+      if(!write)
+	for(ssize_t i = 0; i < res; i++)
+	  ::set_byte(addr + done + i, bounce[i]);
+      done += res;
+      if(!seekable && !write) break;
+    }
+  }
+  set_position(pos);
+  return done;
+}
+
+/* The handle may have been closed, and even reopened, after the file became
+   readable but before the read resumes. */
+task host_files::read_when_ready(file& f) {
+  const std::uint64_t read = ++f.reads;
+  co_await sched->readable(f.fd, f.ready);
+  if(!f.reading || f.reads != read) co_return;
+  f.reading = false;
+  regs[5] = transfer(false);
+}
+
+uint32_t host_files::command(uint32_t op) {
+  switch(op) {
+  case 1:
+    return open(O_RDONLY);
+  case 2:
+    return open(O_WRONLY | O_CREAT | O_TRUNC);
+  case 3:
+    return transfer(false);
+  case 4:
+    return transfer(true);
+  case 5:
+    { const int fd = get_file();
+      if(fd == -1 || (regs[1] != 0 && regs[1] != 2)) return 0xFFFFFFFF;
+      const int whence = regs[1] == 2 ? SEEK_END : SEEK_SET;
+      const off_t pos = lseek(fd, static_cast<off_t>(get_position()), whence);
+      if(pos == -1) return 0xFFFFFFFF;
+      set_position(pos);
+      return pos & 0xFFFFFFFF;
+    }
+  case 6:
+    { const int fd = get_file();
+      if(fd == -1) return 0xFFFFFFFF;
+      file& f = files[regs[4]];
+      if(f.reading) {
+	sched->cancel(f.ready);
+	f.reading = false;
+      }
+      close(fd);
+      f.fd = -1;
+      return 0;
+    }
+  case 7:
+    { const int fd = get_file();
+      if(fd == -1 || !sched) return transfer(false);
+      file& f = files[regs[4]];
+      if(f.reading) return 0xFFFFFFFF;
+      f.reading = true;
+      read_when_ready(f);
+      return 0xFFFFFFFE;
+    }
+  default:
+    return 0xFFFFFFFF;
+  }
+}
+
+timer::timer(uint32_t base, scheduler& sched)
+  : device{base, 15}, sched{sched} {}
+
+task timer::count(uint32_t instructions) {
+  co_await sched.delay(instructions, &counting);
+  counting = {};
+  expired = true;
+}
+
+uint32_t timer::get_word_impl(uint32_t off) {
+  switch(off) {
+  case 4:
+    return expired;
+  case 8:
+    return sched.now() & 0xFFFFFFFF;
+  case 12:
+    return sched.now() >> 32;
+  default:
+    return 0;
+  }
+}
+
+void timer::set_word_impl(uint32_t off, uint32_t word) {
+  if(off == 0) {
+    if(counting) sched.cancel(counting);
+    expired = false;
+    if(word) count(word);
+  }
+  else if(off == 4) expired = false;
+}
+
+uint8_t timer::get_byte_impl(uint32_t off) {
+  return get_word_impl(off & ~3) >> (off & 3)*8 & 0xFF;
+}
+
+void timer::set_byte_impl(uint32_t, uint8_t) {}
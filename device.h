@@ -1,17 +1,29 @@
 // -*- C++ -*-
 #ifndef DEVICE_H_
 #define DEVICE_H_
+#include "scheduler.h"
 #include <memory>
 #include <variant>
 #include <array>
+#include <vector>
+#include <deque>
 #include <atomic>
+#include <mutex>
+#include <functional>
+#include <span>
+#include <algorithm>
 #include <cstring>
+#include <cstdio>
 #include <cstdint>
+#include <optional>
 
 class device {
   std::uint32_t base;
   std::uint32_t lim;
 
+protected:
+  bool array = false;
+
 public:
   device(std::uint32_t base, std::uint32_t lim);
   device(const device&) = delete;
@@ -27,6 +39,9 @@ public:
   std::uint32_t get_base() { return base; }
   std::uint32_t get_limit() { return lim; }
 
+  /* Whether this is an array device, without the cost of a dynamic_cast. */
+  bool is_array() { return array; }
+
 private:
   virtual std::uint8_t get_byte_impl(std::uint32_t) = 0;
   virtual void set_byte_impl(std::uint32_t, std::uint8_t) = 0;
@@ -167,6 +182,14 @@ inline std::uint32_t get_word_raw(std::uint32_t * contents, std::uint32_t limit,
   return res;
 }
 
+/* Memory ordering with several CPUs: each CPU sees its own accesses in
+   program order, but plain loads and stores (including those made here by the
+   fast path, which are ordinary host accesses) are not ordered between CPUs
+   and an unaligned word may be observed torn.  Aligned words are written with
+   a single 32-bit host store.  Accesses to the semaphore device are
+   sequentially consistent host atomics and act as full fences, so stores a
+   CPU makes before releasing a semaphore are visible to a CPU that acquires it
+   afterwards. */
 inline void set_word_raw(std::uint32_t * contents, std::uint32_t limit,
 			 std::uint32_t off, std::uint32_t word) {
   if constexpr(sizeof(std::uint32_t) == 4 && CHAR_BIT == 8) {
@@ -188,8 +211,49 @@ inline void set_word_raw(std::uint32_t * contents, std::uint32_t limit,
   }
 }
 
+/* Bytes and halfwords are little-endian like words, and are accessed a byte
+   at a time. */
+inline bool narrow_in_range(std::uint32_t addr, unsigned size,
+			    std::uint32_t base, std::uint32_t limit) {
+  return addr >= base && addr + (size - 1) - base <= limit;
+}
+
+inline std::uint8_t get_byte_raw(std::uint32_t * contents, std::uint32_t off) {
+  if constexpr(std::endian::native == std::endian::little && CHAR_BIT == 8)
+    return *reinterpret_cast<unsigned char*>(get_offset(contents, off));
+  else return byteconv(get_aligned_ref(contents, off)) >> (off & 3)*8 & 0xFF;
+}
+
+inline void set_byte_raw(std::uint32_t * contents, std::uint32_t off,
+			 std::uint8_t byte) {
+  if constexpr(std::endian::native == std::endian::little && CHAR_BIT == 8)
+    *reinterpret_cast<unsigned char*>(get_offset(contents, off)) = byte;
+  else {
+    std::uint32_t& ref = get_aligned_ref(contents, off);
+    const int bits = (off & 3)*8;
+    ref = byteconv((byteconv(ref) & ~(std::uint32_t{0xFF} << bits))
+		   | std::uint32_t{byte} << bits);
+  }
+}
+
+inline std::uint32_t get_narrow_raw(std::uint32_t * contents,
+				    std::uint32_t off, unsigned size) {
+  std::uint32_t res = 0;
+  for(unsigned i = 0; i < size; i++)
+    res |= std::uint32_t{get_byte_raw(contents, off + i)} << i*8;
+  return res;
+}
+
+inline void set_narrow_raw(std::uint32_t * contents, std::uint32_t off,
+			   unsigned size, std::uint32_t value) {
+  for(unsigned i = 0; i < size; i++)
+    set_byte_raw(contents, off + i, value >> i*8 & 0xFF);
+}
+
 class array_device : public device {
   std::uint32_t * const contents;
+  int backing = -1;
+  std::uint64_t backing_offset = 0;
 
 protected:
   array_device(std::uint32_t*, std::uint32_t, std::uint32_t);
@@ -199,10 +263,35 @@ public:
     return contents;
   }
 
-  void shadow_ROM(std::uint32_t, int, std::uint32_t);
+  /* The descriptor the contents can be mapped from again and their offset in
+     it, or -1 if they cannot be, which is always the case unless memory is
+     backed. */
+  int get_backing() { return backing; }
+  std::uint64_t get_backing_offset() { return backing_offset; }
+
+  /* Copies the file from the given position into the contents at the offset,
+     up to the limit or the end of the file.  Whole pages of plain memory are
+     mapped from the file instead, so that they are only read once touched. */
+  void shadow_ROM(std::uint32_t, int, std::uint32_t, std::uint64_t);
+
+  /* Zeroes the contents from the offset up to the limit, replacing whole pages
+     of plain memory with fresh ones, so that they are only allocated once
+     touched. */
+  void zero(std::uint32_t, std::uint32_t);
 
 private:
+  bool pages_replaceable();
+
+  /* Words running past either end of the device, as the halves of a word
+     straddling two devices do, are accessed a byte at a time. */
+  bool partial(std::uint32_t off) {
+    return off > get_limit() || get_limit() - off < 3;
+  }
+
   std::uint32_t get_word_impl(std::uint32_t off) override {
+    if(partial(off)) [[unlikely]]
+      return get_byte(off) | get_byte(off + 1) << 8 | get_byte(off + 2) << 16
+	| std::uint32_t{get_byte(off + 3)} << 24;
     return get_word_raw(contents, get_limit(), off);
   }
 
@@ -212,6 +301,10 @@ private:
   }
 
   void set_word_impl(std::uint32_t off, std::uint32_t word) override {
+    if(partial(off)) [[unlikely]] {
+      for(int i = 0; i < 4; i++) set_byte(off + i, word >> i*8 & 0xFF);
+      return;
+    }
     set_word_raw(contents, get_limit(), off, word);
   }
 
@@ -225,18 +318,50 @@ private:
 
 extern array_device * largest_readable;
 
-class memory final : public array_device {
+/* Set before creating devices to back memory, shared memory, ROMs and
+   segments by descriptors, so that their contents can be mapped again at
+   another address.  Writable memory is then a shared mapping. */
+extern bool backed_memory;
+
+class memory : public array_device {
 public:
   memory(std::uint32_t, std::uint32_t);
+
+protected:
+  memory(std::uint32_t*, std::uint32_t, std::uint32_t);
 };
 
 extern memory * largest_memory;
 
+/* Memory backed by a named POSIX shared-memory object, created if needed, so
+   that host processes can map it to exchange data with the guest.  The object
+   extends one page past the guest region, rounded up to whole pages, and the
+   first two words of that page count the doorbell rings from the guest to the
+   host and from the host to the guest.  Either side rings the other by
+   incrementing its word and waking waiters on it with FUTEX_WAKE. */
+class shared_memory final : public memory {
+  std::atomic<std::uint32_t> * bells;
+
+public:
+  shared_memory(const char*, std::uint32_t, std::uint32_t);
+
+  std::atomic<std::uint32_t> * get_bells() { return bells; }
+};
+
 class mmap_device : public array_device {
 public:
   mmap_device(int, std::uint32_t, std::uint32_t);
 };
 
+/* Maps a file segment given its offset and size, zero-extended up to the
+   limit.  The mapping is private and the extension is anonymous, so pages are
+   only copied or allocated once touched. */
+class segment_device : public array_device {
+public:
+  segment_device(int, std::uint64_t, std::uint32_t, std::uint32_t,
+		 std::uint32_t);
+};
+
 template<typename T> class read_only_device : public T {
 protected:
   using T::T;
@@ -251,25 +376,246 @@ public:
   mmap_ROM(int, std::uint32_t, std::uint32_t);
 };
 
-class stdio : public device {
-  std::atomic_bool output_finished;
-  std::atomic_bool input_ready;
-  std::uint8_t input;
-  std::uint8_t output;
+class segment_ROM final : public read_only_device<segment_device> {
+public:
+  segment_ROM(int, std::uint64_t, std::uint32_t, std::uint32_t,
+	      std::uint32_t);
+};
+
+/* The values the guest has read from nondeterministic devices (stdio and
+   ticks), so that a run can be repeated exactly.  Reads return the logged
+   values in turn while any remain, instead of consulting the host, and
+   append new values otherwise, writing them to the file if there is one.
+   Output is dropped while re-executing instructions run before. */
+class input_log {
+  /* The values from the position first kept on. */
+  std::vector<std::uint32_t> values;
+  std::size_t first = 0;
+  std::size_t position = 0;
+  std::FILE * const file;
+  const std::uint64_t * retired = nullptr;
+  std::uint64_t frontier = 0;
+
+public:
+  /* Replays the values in the first file, if given, before logging to the
+     second. */
+  input_log(std::FILE*, std::FILE*);
+
+  template<typename T, typename F> T read(F&& host) {
+    if(position - first < values.size())
+      return static_cast<T>(values[position++ - first]);
+    const T res = host();
+    values.push_back(res);
+    position++;
+    if(file) {
+      const unsigned char bytes[4] = {
+	static_cast<unsigned char>(res), static_cast<unsigned char>(res >> 8),
+	static_cast<unsigned char>(res >> 16),
+	static_cast<unsigned char>(res >> 24)
+      };
+      std::fwrite(bytes, 1, 4, file);
+    }
+    return res;
+  }
+
+  std::size_t get_position() const { return position; }
+  void set_position(std::size_t pos) { position = pos; }
+
+  /* The values from the position on. */
+  std::vector<std::uint32_t> since(std::size_t pos) const {
+    return {values.begin() + (pos - first), values.end()};
+  }
+
+  /* Drops the values before the position, which is not gone back before
+     again.  Positions are unchanged. */
+  void forget(std::size_t pos) {
+    values.erase(values.begin(), values.begin() + (pos - first));
+    first = pos;
+  }
+
+  /* Replays the values once those already there have been read. */
+  void append(const std::vector<std::uint32_t>& more) {
+    values.insert(values.end(), more.begin(), more.end());
+  }
+
+  /* Counts instructions by the counter, which is incremented as each
+     instruction starts. */
+  void count(const std::uint64_t& counter) { retired = &counter; }
+
+  /* Notes that the instructions before the current one have been run. */
+  void advance() {
+    if(retired && *retired > frontier) frontier = *retired;
+  }
+
+  /* Notes that the instructions up to the count have been run. */
+  void advance(std::uint64_t count) {
+    if(count > frontier) frontier = count;
+  }
+
+  bool reexecuting() const { return retired && *retired <= frontier; }
+};
+
+extern input_log * inputs;
+
+/* A lock-free byte queue between one producer and one consumer.  Positions
+   only grow, and each side advances its own and waits on the other's. */
+class byte_ring {
+  static constexpr std::size_t capacity = 1 << 16;
+
+  const std::unique_ptr<char[]> buf{new char[capacity]};
+  std::atomic<std::size_t> head{0};
+  std::atomic<std::size_t> tail{0};
+
+public:
+  std::size_t size() const {
+    return head.load(std::memory_order_acquire)
+      - tail.load(std::memory_order_relaxed);
+  }
+
+  char front() const {
+    return buf[tail.load(std::memory_order_relaxed) % capacity];
+  }
+
+  /* The bytes queued, as up to two contiguous spans. */
+  std::array<std::span<const char>, 2> contents() const {
+    const std::size_t t = tail.load(std::memory_order_relaxed);
+    const std::size_t n = head.load(std::memory_order_acquire) - t;
+    const std::size_t first = std::min(n, capacity - t % capacity);
+    return { std::span<const char>{&buf[t % capacity], first},
+	     std::span<const char>{&buf[0], n - first} };
+  }
+
+  void consume(std::size_t n) {
+    tail.store(tail.load(std::memory_order_relaxed) + n,
+	       std::memory_order_release);
+    tail.notify_one();
+  }
+
+  void wait_for_data() const {
+    head.wait(tail.load(std::memory_order_relaxed),
+	      std::memory_order_acquire);
+  }
+
+  bool full() const {
+    return head.load(std::memory_order_relaxed)
+      - tail.load(std::memory_order_acquire) == capacity;
+  }
+
+  void push(char c) {
+    const std::size_t h = head.load(std::memory_order_relaxed);
+    buf[h % capacity] = c;
+    head.store(h + 1, std::memory_order_release);
+    head.notify_one();
+  }
+
+  /* The free space following the bytes queued, up to the end of the
+     buffer. */
+  std::span<char> space() {
+    const std::size_t h = head.load(std::memory_order_relaxed);
+    const std::size_t free =
+      capacity - (h - tail.load(std::memory_order_acquire));
+    return { &buf[h % capacity], std::min(free, capacity - h % capacity) };
+  }
+
+  void produce(std::size_t n) {
+    head.store(head.load(std::memory_order_relaxed) + n,
+	       std::memory_order_release);
+    head.notify_one();
+  }
+
+  void wait_for_space() const {
+    tail.wait(head.load(std::memory_order_relaxed) - capacity,
+	      std::memory_order_acquire);
+  }
+};
+
+/* The one host thread serving every device backed by host files, waiting on
+   them with epoll.  Handlers run on that thread with the events that were
+   ready; they must stay alive while watched.  The thread starts on first
+   use. */
+class reactor {
+  const int epfd;
+
+  reactor();
+  void run();
+
+public:
+  using handler = std::function<void(std::uint32_t)>;
+
+  static reactor& instance();
+
+  /* Returns false if the descriptor cannot be watched, as with regular
+     files. */
+  bool watch(int, std::uint32_t, handler&);
+  void rewatch(int, std::uint32_t, handler&);
+  void unwatch(int);
+};
 
-  void reader();
-  void writer();
+/* A serial line over host file descriptors, through rings.  Input is read
+   ahead in large chunks by the reactor, or straight from a mapping if it is a
+   regular file.  Output is written out by the reactor once enough has
+   gathered or a little time has passed, and whatever is still queued is
+   written out at exit.  The guest wakes the reactor through an eventfd when it
+   queues output into an empty ring or makes room in a full input ring.  Only
+   one CPU should use the device at a time.
+
+   Reading word 0 takes the next input byte.  Byte 0 is that byte, and byte 1
+   has bit 0 set once there is input and bit 1 set at its end.  Byte 4 reads
+   as 1 while there is room for output, and writing it queues a byte. */
+class uart : public device {
+  friend void release_devices();
+
+  byte_ring input;
+  byte_ring output;
+  std::atomic_bool input_ended{false};
+  std::atomic_bool input_paused{false};
+  const int in_fd;
+  const int out_fd;
+  int kick_fd = -1;
+  int timer_fd = -1;
+  bool out_polled = false;
+  bool timer_armed = false;
+  const char * mapped = nullptr;
+  std::size_t mapped_size = 0;
+  std::size_t mapped_pos = 0;
+  bool input_mapped = false;
+  std::mutex flushing;
+  reactor::handler on_input, on_output, on_kick, on_timer;
+
+  static std::vector<uart*> started;
+  static void flush_started();
+
+  void kick();
+  void fill();
+  void drain();
+  bool write_out(std::size_t);
+  void flush();
 
 public:
-  stdio(std::uint32_t);
+  /* The descriptors may be the same.  The device is served once started,
+     by the constructor unless told not to. */
+  uart(std::uint32_t, int, int, bool = true);
+
+  void start();
 
 private:
-  std::uint8_t iget_byte(std::uint32_t, bool);
+  int next_input();
+  std::uint8_t iget_byte(std::uint32_t, int);
   std::uint8_t get_byte_impl(std::uint32_t) override;
   void set_byte_impl(std::uint32_t, std::uint8_t) override;
+  std::uint32_t iget_word(std::uint32_t);
   std::uint32_t get_word_impl(std::uint32_t) override;
 };
 
+/* The serial line over standard input and output, which puts a terminal into
+   raw mode. */
+class stdio final : public uart {
+public:
+  stdio(std::uint32_t, bool = true);
+
+  void start();
+};
+
 class ticks : public read_only_device<device> {
 public:
   ticks(std::uint32_t);
@@ -287,6 +633,231 @@ private:
   std::uint8_t get_byte_impl(std::uint32_t) override;
 };
 
+/* A 32-bit 0x00RRGGBB framebuffer of the given width and height, followed by
+   four registers: width, height, the number of frames emitted so far, and a
+   control register whose bit 0 enables output.  Stores are tracked in 16x16
+   tiles, and the reactor writes only the tiles changed since the last frame
+   to the output at a fixed frame rate, either as raw tile records or as
+   complete PPM images.  A raw frame is a header of two little-endian words,
+   the frame number and the number of tiles, followed by each tile as four
+   little-endian halfwords (x, y, width and height in pixels) and its pixels
+   row by row, four bytes each as stored by the guest. */
+class framebuffer final : public array_device {
+  static constexpr std::uint32_t tile = 16;
+
+  const std::uint32_t width;
+  const std::uint32_t height;
+  const std::uint32_t tiles_x;
+  const std::uint32_t tiles_y;
+  std::vector<std::atomic<std::uint64_t>> dirty;
+  std::vector<unsigned char> frame;
+  const int fd;
+  const bool ppm;
+  int timer_fd;
+  std::uint32_t frames = 0;
+  reactor::handler on_frame;
+
+  std::uint32_t registers() { return width*height*4; }
+  void mark(std::uint32_t);
+
+  bool output(std::uint32_t);
+  void encode();
+
+public:
+  framebuffer(std::uint32_t, std::uint32_t, std::uint32_t, int, bool,
+	      unsigned);
+
+private:
+  void set_word_impl(std::uint32_t, std::uint32_t) override;
+  void set_byte_impl(std::uint32_t, std::uint8_t) override;
+};
+
+/* Doorbell for a shared memory region.  Writing the low byte of word 0 rings
+   the host.  Reading word 0 returns the number of rings sent to the host and
+   word 1 the number received from it; reading word 2 waits until the host has
+   rung since the last such read and returns the number received. */
+class doorbell : public device {
+  std::atomic<std::uint32_t> * const bells;
+  std::atomic<std::uint32_t> seen{0};
+
+public:
+  doorbell(std::uint32_t, shared_memory&);
+
+private:
+  std::uint32_t get_word_impl(std::uint32_t) override;
+  std::uint8_t get_byte_impl(std::uint32_t) override;
+  void set_byte_impl(std::uint32_t, std::uint8_t) override;
+};
+
+/* For the exit handlers: stops devices waiting for the host from then on,
+   and wakes CPUs waiting in them, writing out uart output to make room, so
+   that they reach the end of their block. */
+void release_devices();
+
+/* The index of the CPU running on the calling thread. */
+extern thread_local std::uint32_t current_cpu;
+
+/* Synchronization for multiple CPUs.  Word 0 reads as the index of the
+   accessing CPU and word 1 as the number of CPUs.  From offset 16 follow 64
+   four-word semaphores; writing any of their words sets the value, and reading
+   word 0 returns it, word 1 atomically sets it to 1 (test-and-set), and words
+   2 and 3 atomically increment and decrement it, all returning the previous
+   value. */
+class semaphores : public device {
+  static constexpr int count = 64;
+
+  const std::uint32_t cpus;
+  std::array<std::atomic<std::uint32_t>, count> values{};
+
+public:
+  semaphores(std::uint32_t, std::uint32_t);
+
+private:
+  std::uint32_t get_word_impl(std::uint32_t) override;
+  void set_word_impl(std::uint32_t, std::uint32_t) override;
+  std::uint8_t get_byte_impl(std::uint32_t) override;
+  void set_byte_impl(std::uint32_t, std::uint8_t) override;
+};
+
+/* The counts of guest events kept for the CPU running on the calling thread
+   once it counts accesses, as of the end of its last block: instructions
+   started, control transfers taken, loads, stores, and loads and stores of
+   devices other than array devices. */
+using guest_counts = std::array<std::uint64_t, 5>;
+extern thread_local const guest_counts * current_counts;
+
+/* Performance counters for the guest to measure itself with, each CPU seeing
+   its own, which count only on CPUs counting accesses.  Counts are brought up
+   to date at the end of each block, so a read sees those up to the last
+   control transfer.  Word 0 is the control: writing bit 0 resets the
+   counters, and bit 1 freezes them while set, which reads back.  From offset
+   8 follow the 64-bit counters in the order of guest_counts, low word first;
+   reading a low word latches the high word, so that a counter reads
+   consistently. */
+class perf_counters : public device {
+  struct cpu_counters {
+    guest_counts base{};
+    guest_counts frozen{};
+    bool is_frozen = false;
+    std::uint32_t latched = 0;
+  };
+
+  std::vector<cpu_counters> cpus;
+
+  std::uint64_t value(cpu_counters&, std::size_t);
+
+public:
+  perf_counters(std::uint32_t, std::uint32_t);
+
+private:
+  std::uint32_t get_word_impl(std::uint32_t) override;
+  void set_word_impl(std::uint32_t, std::uint32_t) override;
+  std::uint8_t get_byte_impl(std::uint32_t) override;
+  void set_byte_impl(std::uint32_t, std::uint8_t) override;
+};
+
+/* A device made of N 32-bit registers, the last of which is a command
+   register: writing its low byte runs the command, and reading it returns the
+   command's result. */
+template<std::size_t N> class command_device : public device {
+protected:
+  std::array<std::uint32_t, N> regs{};
+
+  command_device(std::uint32_t base) : device{base, N*4 - 1} {}
+
+private:
+  virtual std::uint32_t command(std::uint32_t) = 0;
+
+  std::uint8_t get_byte_impl(std::uint32_t off) override {
+    return regs[off >> 2] >> (off & 3)*8 & 0xFF;
+  }
+
+  void set_byte_impl(std::uint32_t off, std::uint8_t byte) override {
+    if(off >= (N - 1)*4) {
+      if(off == (N - 1)*4) regs[N - 1] = command(byte);
+      return;
+    }
+    const std::uint32_t bstart = (off & 3)*8;
+    regs[off >> 2] = (regs[off >> 2] & ~(0xFF << bstart))
+      | std::uint32_t{byte} << bstart;
+  }
+};
+
+/* Block copy/fill/compare engine.  Registers: 0 source (fill byte for fill),
+   4 destination, 8 length in bytes, 12 command.  Writing 1 copies, 2 fills
+   and 3 compares; a compare returns the number of leading bytes that are
+   equal. */
+class dma : public command_device<4> {
+public:
+  dma(std::uint32_t);
+
+private:
+  std::uint32_t command(std::uint32_t) override;
+};
+
+/* Host file access.  Registers: 0 guest address, 4 length, 8 and 12 file
+   position (low and high words), 16 handle, 20 command.  Commands: 1 opens the
+   file named by the address and length for reading and 2 for writing, both
+   returning a handle; 3 reads and 4 writes length bytes at the file position,
+   advancing it and returning the number of bytes transferred, which from a
+   pipe or socket is what one host read returns; 5 seeks, taking the whence
+   value from the length register and the offset from the position, and
+   returns the low word of the new position; 6 closes the handle.  Failure is
+   reported as 0xFFFFFFFF.  Given a scheduler, command 7 reads like 3 once the
+   file can be read without blocking, meanwhile reading as 0xFFFFFFFE, and the
+   registers must be left alone until it completes; otherwise it is the same
+   as 3.  Command 7 fails on a handle that already has a read pending, and
+   closing the handle drops the read. */
+class host_files : public command_device<6> {
+  /* An open handle, or a closed one if fd is -1, and the read pending on it
+     if reading.  Kept in place for the reactor. */
+  struct file {
+    int fd;
+    bool reading = false;
+    std::uint64_t reads = 0;
+    scheduler::readable_wait ready;
+
+    explicit file(int fd) : fd{fd} {}
+  };
+
+  std::deque<file> files;
+  scheduler * const sched;
+
+  int get_file();
+  std::uint64_t get_position();
+  void set_position(std::uint64_t);
+  std::uint32_t open(int);
+  std::uint32_t transfer(bool);
+  task read_when_ready(file&);
+
+public:
+  host_files(std::uint32_t, scheduler* = nullptr);
+
+private:
+  std::uint32_t command(std::uint32_t) override;
+};
+
+/* A timer counting guest instructions on a scheduler.  Writing word 0 starts
+   it to expire that many instructions later, or stops it if 0.  Word 4 reads
+   as 1 once it has expired, and writing it clears that.  Words 8 and 12 read
+   as the low and high words of the guest time. */
+class timer : public device {
+  scheduler& sched;
+  scheduler::pending counting;
+  bool expired = false;
+
+  task count(std::uint32_t);
+
+public:
+  timer(std::uint32_t, scheduler&);
+
+private:
+  std::uint32_t get_word_impl(std::uint32_t) override;
+  void set_word_impl(std::uint32_t, std::uint32_t) override;
+  std::uint8_t get_byte_impl(std::uint32_t) override;
+  void set_byte_impl(std::uint32_t, std::uint8_t) override;
+};
+
 inline device * get_device(std::uint32_t addr) {
   return std::visit([&](const auto& val3) {
     if constexpr(std::is_same_v<decltype(val3), device* const&>)
@@ -324,10 +895,42 @@ inline void set_word(std::uint32_t addr, std::uint32_t word) {
   device * const dev1 = get_device(addr);
   dev1->set_word(addr - dev1->get_base(), word);
   if(addr & 3) {
-    device * const dev2 = get_device(addr);
+    device * const dev2 = get_device(addr + 3);
     if(dev1 != dev2)
       dev2->set_word(addr - dev2->get_base(), word);
   }
 }
 
+inline std::uint32_t get_narrow(std::uint32_t addr, unsigned size) {
+  std::uint32_t res = 0;
+  for(unsigned i = 0; i < size; i++)
+    res |= std::uint32_t{get_byte(addr + i)} << i*8;
+  return res;
+}
+
+inline void set_narrow(std::uint32_t addr, unsigned size,
+		       std::uint32_t value) {
+  for(unsigned i = 0; i < size; i++) set_byte(addr + i, value >> i*8 & 0xFF);
+}
+
+/* The devices the guest can write as plain memory, whose contents make up a
+   checkpoint. */
+std::vector<array_device*> checkpointed_devices();
+
+/* Returns the host bytes backing a guest range if the whole range is served by
+   a single array device (by a memory device if the range is to be written),
+   and NULL otherwise. */
+char * host_range(std::uint32_t, std::uint32_t, bool);
+
+/* Reads the word at addr if a single array device serves all of it, and
+   nothing otherwise, so that code can be decoded ahead of running it without
+   the side effects of reading a device register. */
+inline std::optional<std::uint32_t> peek_word(std::uint32_t addr) {
+  const char * const bytes = host_range(addr, 4, false);
+  if(!bytes) return {};
+  std::uint32_t res;
+  std::memcpy(&res, bytes, sizeof(res));
+  return byteconv(res);
+}
+
 #endif
@@ -1,42 +1,234 @@
-#include "emulate.h"
+#define _POSIX_C_SOURCE 200809L
+#include "inst.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
 
-static const char * const ops[] = {
-  "add", "sub", "and", "or", "xor", "not", "load", "store", "jump", "branch",
-  "cmp", "invalid", "beq", "bne", "blt", "bgt", "loadi", "call", "loadi16",
-  "loadi16h"
+enum output { LISTING, DOT, JSON };
+
+/* The most threads -j gives, far more than decoding can use. */
+enum { max_threads = 256 };
+
+static const unsigned char * image;
+static size_t count;
+static uint32_t origin;
+static atomic_uchar * leaders;
+
+static inline uint32_t fetch(size_t i) {
+  const unsigned char * const p = image + i*4;
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Returns the index of the branch target of instruction i, or count if it has
+   none within the image. */
+static inline size_t target(size_t i, uint32_t inst) {
+  if(!is_branch(inst_opcode(inst))) return count;
+  const uint32_t addr = origin + (uint32_t)i*4 + 4 + inst_imm(inst);
+  const uint32_t off = addr - origin;
+  if(off & 3 || off/4 >= count) return count;
+  return off/4;
+}
+
+struct chunk {
+  size_t start, end;
+  char * text;
+  size_t size;
 };
 
-static inline const char * op_name(enum opcode opcode) {
-  if(opcode > sizeof(ops)/sizeof(char*))
-    return "invalid";
-  return ops[opcode];
+static void * find_leaders(void * arg) {
+  const struct chunk * const ch = arg;
+  for(size_t i = ch->start; i < ch->end; i++) {
+    const uint32_t inst = fetch(i);
+    if(!ends_block(inst, true)) continue;
+    if(i + 1 < count)
+      atomic_store_explicit(&leaders[i + 1], 1, memory_order_relaxed);
+    const size_t t = target(i, inst);
+    if(t < count) atomic_store_explicit(&leaders[t], 1, memory_order_relaxed);
+  }
+  return NULL;
 }
 
-static void disassemble(FILE * in) {
-  while(true) {
-    uint32_t inst = 0;
-    for(int i = 0; i <= 3; i++) {
-      const int c = getc(in);
-      if(feof(in)) return;
-      inst |= (c & 0xFF) << i*8;
+static void * list(void * arg) {
+  struct chunk * const ch = arg;
+  FILE * const fp = open_memstream(&ch->text, &ch->size);
+  if(!fp) return NULL;
+  for(size_t i = ch->start; i < ch->end; i++) {
+    const uint32_t addr = origin + (uint32_t)i*4;
+    const uint32_t inst = fetch(i);
+    if(atomic_load_explicit(&leaders[i], memory_order_relaxed))
+      fprintf(fp, "L_%08lx:\n", (unsigned long)addr);
+    fprintf(fp, "%08lx:\t", (unsigned long)addr);
+    print_inst(inst, fp);
+    const size_t t = target(i, inst);
+    if(t < count) {
+      fseek(fp, -1, SEEK_CUR);
+      fprintf(fp, "\t; L_%08lx\n", (unsigned long)(origin + (uint32_t)t*4));
     }
-    print_inst(inst, stdout);
   }
+  fclose(fp);
+  return NULL;
 }
 
-int main(int argc, const char ** argv) {
-  if(argc < 2) {
+static void run_chunks(void * (*fn)(void*), struct chunk * chunks, int n) {
+  pthread_t * const threads = malloc(n * sizeof(*threads));
+  int started = 0;
+  for(; threads && started < n; started++)
+    if(pthread_create(&threads[started], NULL, fn, &chunks[started]) != 0)
+      break;
+  for(int i = started; i < n; i++) fn(&chunks[i]);
+  for(int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+/* Parses a whole number in base, or exits with a usage error naming opt. */
+static unsigned long parse_number(const char * arg, int base, char opt) {
+  char * end;
+  errno = 0;
+  const unsigned long res = strtoul(arg, &end, base);
+  if(*arg == '\0' || *end != '\0' || errno != 0) {
+    fprintf(stderr, "bad number supplied to option -%c\n", opt);
+    exit(-1);
+  }
+  return res;
+}
+
+static void print_cfg(enum output output) {
+  bool first = true;
+  if(output == DOT)
+    puts("digraph cfg {\n  node [shape=box fontname=monospace];");
+  else fputs("{\"blocks\":[", stdout);
+  for(size_t start = 0; start < count;) {
+    size_t end = start + 1;
+    while(end < count && !leaders[end]) end++;
+    const uint32_t last = fetch(end - 1);
+    const enum opcode opcode = inst_opcode(last);
+    size_t succs[2];
+    int nsuccs = 0;
+    const size_t t = target(end - 1, last);
+    if(t < count) succs[nsuccs++] = t;
+    if(end < count && opcode != OP_JUMP && opcode != OP_CALL
+       && (!ends_block(last, true) || is_branch(opcode)))
+      succs[nsuccs++] = end;
+    const unsigned long saddr = origin + (uint32_t)start*4;
+    const unsigned long eaddr = origin + (uint32_t)(end - 1)*4;
+    if(output == DOT) {
+      printf("  b_%08lx [label=\"%08lx-%08lx\\n%zu instructions\"];\n",
+	     saddr, saddr, eaddr, end - start);
+      for(int i = 0; i < nsuccs; i++)
+	printf("  b_%08lx -> b_%08lx%s;\n", saddr,
+	       (unsigned long)(origin + (uint32_t)succs[i]*4),
+	       nsuccs == 2 && i == 0 ? " [label=\"taken\"]" : "");
+    }
+    else {
+      printf("%s\n{\"start\":%lu,\"end\":%lu,\"instructions\":%zu,"
+	     "\"successors\":[", first ? "" : ",", saddr, eaddr, end - start);
+      for(int i = 0; i < nsuccs; i++)
+	printf("%s%lu", i ? "," : "",
+	       (unsigned long)(origin + (uint32_t)succs[i]*4));
+      printf("]}");
+    }
+    first = false;
+    start = end;
+  }
+  puts(output == DOT ? "}" : "\n]}");
+}
+
+int main(int argc, char * const * argv) {
+  enum output output = LISTING;
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int c;
+  while((c = getopt(argc, argv, "j:o:g:")) != -1) {
+    switch(c) {
+    case 'j':
+      { const unsigned long n = parse_number(optarg, 10, c);
+	nthreads = n < max_threads ? (long)n : max_threads;
+      }
+      break;
+    case 'o':
+      { const unsigned long o = parse_number(optarg, 16, c);
+	if(o > 0xFFFFFFFF) {
+	  fprintf(stderr, "origin out of range: %s\n", optarg);
+	  return -1;
+	}
+	origin = o;
+      }
+      break;
+    case 'g':
+      if(strcmp(optarg, "dot") == 0) output = DOT;
+      else if(strcmp(optarg, "json") == 0) output = JSON;
+      else {
+	fprintf(stderr, "unknown graph format: %s\n", optarg);
+	return -1;
+      }
+      break;
+    default:
+      return -1;
+    }
+  }
+  if(optind >= argc) {
     fprintf(stderr, "not enough arguments\n");
     return -1;
   }
-  FILE * in = fopen(argv[1], "rb");
-  if(!in) {
-    fprintf(stderr, "cannot open %s: ", argv[1]);
+  const char * const name = argv[optind];
+  const int fd = open(name, O_RDONLY);
+  struct stat st;
+  if(fd == -1 || fstat(fd, &st) == -1) {
+    fprintf(stderr, "cannot open %s: ", name);
     perror("");
     return -2;
   }
-  disassemble(in);
+  count = st.st_size / 4;
+  if(count == 0) return 0;
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(image == MAP_FAILED) {
+    fprintf(stderr, "cannot map %s: ", name);
+    perror("");
+    return -2;
+  }
+  posix_madvise((void*)image, st.st_size, POSIX_MADV_SEQUENTIAL);
+  leaders = calloc(count, sizeof(*leaders));
+  if(!leaders) {
+    perror("cannot allocate memory");
+    return -3;
+  }
+  leaders[0] = 1;
+
+  if(nthreads < 1) nthreads = 1;
+  if(nthreads > max_threads) nthreads = max_threads;
+  if((size_t)nthreads > count) nthreads = count;
+  struct chunk * const chunks = malloc(nthreads * sizeof(*chunks));
+  if(!chunks) {
+    perror("cannot allocate memory");
+    return -3;
+  }
+  for(long i = 0; i < nthreads; i++) {
+    chunks[i].start = count * i / nthreads;
+    chunks[i].end = count * (i + 1) / nthreads;
+    chunks[i].text = NULL;
+    chunks[i].size = 0;
+  }
+  run_chunks(find_leaders, chunks, nthreads);
+
+  if(output != LISTING) {
+    print_cfg(output);
+    return 0;
+  }
+  run_chunks(list, chunks, nthreads);
+  for(long i = 0; i < nthreads; i++) {
+    if(!chunks[i].text) {
+      perror("cannot disassemble");
+      return -3;
+    }
+    fwrite(chunks[i].text, 1, chunks[i].size, stdout);
+    free(chunks[i].text);
+  }
   return 0;
 }
@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L
+#include "elf.h"
+#include "device.h"
+#include <elf.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+using std::uint32_t;
+
+static std::vector<symbol> symbols;
+
+[[noreturn]] static void bad_elf(const char * name, const char * why) {
+  std::cerr << name << ": " << why << '\n';
+  std::exit(-3);
+}
+
+static void read_at(const char * name, int fd, void * buf, std::size_t size,
+		    off_t off) {
+  char * cur = static_cast<char*>(buf);
+  while(size > 0) {
+    const ssize_t nread = pread(fd, cur, size, off);
+    if(nread == -1) {
+      std::cerr << "cannot read " << name << ": ";
+      std::perror("");
+      std::exit(-3);
+    }
+    if(nread == 0) bad_elf(name, "truncated ELF file");
+    cur += nread;
+    size -= nread;
+    off += nread;
+  }
+}
+
+template<typename T> static std::vector<T>
+read_table(const char * name, int fd, off_t off, std::size_t count) {
+  std::vector<T> res(count);
+  read_at(name, fd, res.data(), count * sizeof(T), off);
+  return res;
+}
+
+/* Segments in memory are mapped from the file a page at a time where the
+   file lines up, and their zeroed part is only allocated once touched. */
+static void load_segment(const char * name, int fd, off_t file_size,
+			 const Elf32_Phdr& ph) {
+  if(ph.p_memsz == 0) return;
+  const uint32_t size = std::min(ph.p_filesz, ph.p_memsz);
+  const uint32_t limit = ph.p_memsz - 1;
+  if(ph.p_offset + std::uint64_t{size}
+     > static_cast<std::uint64_t>(file_size))
+    bad_elf(name, "truncated ELF file");
+  device * const start = get_device(ph.p_vaddr);
+  if(host_range(ph.p_vaddr, ph.p_memsz, true)) {
+    const auto mem = static_cast<array_device*>(start);
+    const uint32_t off = ph.p_vaddr - mem->get_base();
+    if(size > 0) mem->shadow_ROM(off, fd, size - 1, ph.p_offset);
+    if(ph.p_memsz > size) mem->zero(off + size, limit - size);
+  }
+  else if(start == get_device(ph.p_vaddr + limit)
+	  && dynamic_cast<memory*>(start))
+    bad_elf(name, "segment overlaps another device");
+  else if(ph.p_flags & PF_W)
+    new segment_device(fd, ph.p_offset, size, ph.p_vaddr, limit);
+  else new segment_ROM(fd, ph.p_offset, size, ph.p_vaddr, limit);
+}
+
+static void load_symbols(const char * name, int fd, const Elf32_Ehdr& eh) {
+  if(eh.e_shoff == 0 || eh.e_shentsize != sizeof(Elf32_Shdr)) return;
+  const auto sections =
+    read_table<Elf32_Shdr>(name, fd, eh.e_shoff, eh.e_shnum);
+  for(const auto& sh : sections) {
+    if(sh.sh_type != SHT_SYMTAB || sh.sh_link >= sections.size()) continue;
+    const auto syms = read_table<Elf32_Sym>(name, fd, sh.sh_offset,
+					    sh.sh_size / sizeof(Elf32_Sym));
+    const auto& strsh = sections[sh.sh_link];
+    const auto strtab =
+      read_table<char>(name, fd, strsh.sh_offset, strsh.sh_size);
+    for(const auto& sym : syms) {
+      const int type = ELF32_ST_TYPE(sym.st_info);
+      if(sym.st_shndx == SHN_UNDEF || sym.st_name >= strtab.size()
+	 || (type != STT_FUNC && type != STT_OBJECT && type != STT_NOTYPE))
+	continue;
+      const char * const sname = &strtab[sym.st_name];
+      const auto len = strnlen(sname, strtab.size() - sym.st_name);
+      if(len == 0 || sname[0] == '$' || sname[0] == '.') continue;
+      symbols.push_back({ sym.st_value, sym.st_size,
+			  std::string{sname, len} });
+    }
+  }
+  std::sort(symbols.begin(), symbols.end(), [](const auto& a, const auto& b) {
+    return a.addr < b.addr;
+  });
+}
+
+uint32_t load_elf(const char * name) {
+  const int fd = open(name, O_RDONLY);
+  if(fd == -1) {
+    std::cerr << "cannot open " << name << " for reading: ";
+    std::perror("");
+    std::exit(-3);
+  }
+  Elf32_Ehdr eh;
+  read_at(name, fd, &eh, sizeof(eh), 0);
+  if(std::memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0)
+    bad_elf(name, "not an ELF file");
+  if(eh.e_ident[EI_CLASS] != ELFCLASS32 || eh.e_ident[EI_DATA] != ELFDATA2LSB)
+    bad_elf(name, "not a 32-bit little-endian ELF file");
+  if(eh.e_type != ET_EXEC || eh.e_phentsize != sizeof(Elf32_Phdr))
+    bad_elf(name, "not an ELF executable");
+  struct stat st;
+  if(fstat(fd, &st) == -1) {
+    std::cerr << "cannot stat " << name << ": ";
+    std::perror("");
+    std::exit(-3);
+  }
+  for(const auto& ph : read_table<Elf32_Phdr>(name, fd, eh.e_phoff,
+					       eh.e_phnum))
+    if(ph.p_type == PT_LOAD) load_segment(name, fd, st.st_size, ph);
+  load_symbols(name, fd, eh);
+  return eh.e_entry;
+}
+
+const symbol * find_symbol(uint32_t addr) {
+  auto it = std::upper_bound(symbols.begin(), symbols.end(), addr,
+			     [](uint32_t addr, const symbol& sym) {
+			       return addr < sym.addr;
+			     });
+  if(it == symbols.begin()) return nullptr;
+  const uint32_t start = std::prev(it)->addr;
+  while(it != symbols.begin() && std::prev(it)->addr == start) {
+    --it;
+    if(it->size == 0 || addr - it->addr < it->size) return &*it;
+  }
+  return nullptr;
+}
+
+std::string symbolize(uint32_t addr) {
+  const symbol * const sym = find_symbol(addr);
+  if(!sym) return {};
+  if(addr == sym->addr) return sym->name;
+  char off[16];
+  std::snprintf(off, sizeof(off), "+0x%lx",
+		static_cast<unsigned long>(addr - sym->addr));
+  return sym->name + off;
+}
@@ -0,0 +1,24 @@
+// -*- C++ -*-
+#ifndef ELF_H_
+#define ELF_H_
+#include <string>
+#include <cstdint>
+
+/* Loads the PT_LOAD segments of an ELF image, copying those that fall within
+   a memory device into it and mapping the others directly, and reads its
+   symbol table.  Returns the entry point. */
+std::uint32_t load_elf(const char*);
+
+struct symbol {
+  std::uint32_t addr;
+  std::uint32_t size;
+  std::string name;
+};
+
+/* Returns the symbol containing the address, or NULL if there is none. */
+const symbol * find_symbol(std::uint32_t);
+
+/* Returns "name+offset" for the address, or an empty string. */
+std::string symbolize(std::uint32_t);
+
+#endif
@@ -1,12 +1,36 @@
 #define _POSIX_C_SOURCE 200809L
 #include "cpu.h"
 #include "device.h"
+#include "profile.h"
+#include "elf.h"
+#include "lockstep.h"
+#include "analysis.h"
+#include "plugin_host.h"
+#include "record.h"
+#include "server.h"
+#include "introspect.h"
+#include "fastmem.h"
+#include "hostperf.h"
+#include "scheduler.h"
+#include "isa.h"
+#include "sampling.h"
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <unistd.h>
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <memory>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include <utility>
+#include <tuple>
+#include <string_view>
 #include <optional>
 #include <charconv>
 #include <system_error>
@@ -41,16 +65,143 @@ static auto open_ROM(const char * name) {
   return std::pair{fd, limit};
 }
 
+/* Opens the host side of a serial line: a Unix socket is connected to, a
+   regular file is appended to, and anything else, such as a FIFO or a
+   terminal, is opened for reading and writing. */
+static int open_uart(const char * name) {
+  struct stat st;
+  int fd;
+  if(stat(name, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if(std::strlen(name) >= sizeof(addr.sun_path)) {
+      std::cerr << "socket name " << name << " is too long\n";
+      std::exit(-1);
+    }
+    std::strcpy(addr.sun_path, name);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd != -1 && connect(fd, reinterpret_cast<sockaddr*>(&addr),
+			   sizeof(addr)) == -1) {
+      close(fd);
+      fd = -1;
+    }
+    if(fd != -1) fcntl(fd, F_SETFL, O_NONBLOCK);
+  }
+  else if(stat(name, &st) == -1 || S_ISREG(st.st_mode))
+    fd = open(name, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  else fd = open(name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if(fd == -1) {
+    std::cerr << "cannot open " << name << " as a serial line: ";
+    std::perror("");
+    std::exit(-3);
+  }
+  return fd;
+}
+
+/* The CPUs, and the threads running CPUs 1 and up.  The first exit handler to
+   run stops them all, releasing any waiting in devices, so that the later ones
+   can tear down what the CPUs use. */
+static std::vector<CPU*> all_cpus;
+static std::vector<std::thread> cpu_threads;
+static std::thread::id main_thread;
+static std::atomic_bool main_stopped{false};
+
+static void stop_cpus() {
+  CPU::exiting.store(true);
+  for(CPU * cpu : all_cpus) cpu->interrupt();
+  release_devices();
+  for(std::thread& thread : cpu_threads)
+    if(thread.get_id() == std::this_thread::get_id()) thread.detach();
+    else thread.join();
+  // CPU 0 stops where main returns from running it.
+  if(std::this_thread::get_id() != main_thread) main_stopped.wait(false);
+}
+
 int main(int argc, char * const * argv) {
   new zero_device{0, 0xFFFFFFFF};
   std::optional<uint32_t> stdio_base;
   std::optional<uint32_t> ticks_base;
+  std::optional<uint32_t> dma_base;
+  std::optional<uint32_t> host_files_base;
+  const char * profile_name = NULL;
+  const char * folded_name = NULL;
+  unsigned profile_hz = 997;
+  unsigned ncpus = 1;
+  std::optional<uint32_t> semaphores_base;
+  const char * elf_name = NULL;
+  std::optional<uint32_t> framebuffer_base;
+  uint32_t framebuffer_width, framebuffer_height;
+  const char * framebuffer_name = NULL;
+  bool framebuffer_ppm = false;
+  unsigned framebuffer_fps = 30;
+  std::optional<uint32_t> doorbell_base;
+  bool check_lockstep = false;
+  std::optional<cache_model> icache, dcache;
+  std::optional<branch_predictor> bpred;
+  const char * analysis_name = NULL;
+  unsigned sample_interval = 0;
+  unsigned sample_jobs = std::max(std::thread::hardware_concurrency(), 1u);
+  std::vector<const char*> plugin_specs;
+  bool recording = false;
+  const char * record_name = NULL;
+  const char * replay_name = NULL;
+  unsigned checkpoint_interval = 10000000;
+  unsigned max_checkpoints = 32;
+  const char * server_name = NULL;
+  std::optional<uint32_t> init_point;
+  bool introspect = false;
+  const char * control_name = NULL;
+  std::vector<std::pair<uint32_t, const char*>> uart_specs;
+  bool fastmem = false;
+  std::optional<uint32_t> counters_base;
+  bool host_events = false;
+  std::optional<uint32_t> timer_base;
   const option opts[] = {
     { .name = "stdio", .has_arg = true, .flag = NULL, .val = 's' },
     { .name = "memory", .has_arg = true, .flag = NULL, .val = 'm' },
     { .name = "rom", .has_arg = true, .flag = NULL, .val = 'r' },
     { .name = "break", .has_arg = true, .flag = NULL, .val = 'b' },
     { .name = "ticks", .has_arg = true, .flag = NULL, .val = 't' },
+    { .name = "dma", .has_arg = true, .flag = NULL, .val = 'd' },
+    { .name = "host-files", .has_arg = true, .flag = NULL, .val = 'f' },
+    { .name = "profile", .has_arg = true, .flag = NULL, .val = 'p' },
+    { .name = "profile-folded", .has_arg = true, .flag = NULL, .val = 'F' },
+    { .name = "profile-hz", .has_arg = true, .flag = NULL, .val = 'H' },
+    { .name = "cpus", .has_arg = true, .flag = NULL, .val = 'c' },
+    { .name = "reset", .has_arg = true, .flag = NULL, .val = 'v' },
+    { .name = "semaphores", .has_arg = true, .flag = NULL, .val = 'x' },
+    { .name = "elf", .has_arg = true, .flag = NULL, .val = 'e' },
+    { .name = "shm", .has_arg = true, .flag = NULL, .val = 'S' },
+    { .name = "doorbell", .has_arg = true, .flag = NULL, .val = 'D' },
+    { .name = "lockstep", .has_arg = false, .flag = NULL, .val = 'l' },
+    { .name = "icache", .has_arg = true, .flag = NULL, .val = 'I' },
+    { .name = "dcache", .has_arg = true, .flag = NULL, .val = 'C' },
+    { .name = "bpred", .has_arg = true, .flag = NULL, .val = 'P' },
+    { .name = "analysis", .has_arg = true, .flag = NULL, .val = 'A' },
+    { .name = "debug-script", .has_arg = true, .flag = NULL, .val = 'y' },
+    { .name = "plugin", .has_arg = true, .flag = NULL, .val = 'L' },
+    { .name = "framebuffer", .has_arg = true, .flag = NULL, .val = 'g' },
+    { .name = "framebuffer-output", .has_arg = true, .flag = NULL, .val = 'o' },
+    { .name = "framebuffer-format", .has_arg = true, .flag = NULL, .val = 'k' },
+    { .name = "framebuffer-fps", .has_arg = true, .flag = NULL, .val = 'q' },
+    { .name = "record", .has_arg = optional_argument, .flag = NULL,
+      .val = 'R' },
+    { .name = "replay", .has_arg = true, .flag = NULL, .val = 'Y' },
+    { .name = "checkpoint-interval", .has_arg = true, .flag = NULL,
+      .val = 'K' },
+    { .name = "checkpoints", .has_arg = true, .flag = NULL, .val = 'N' },
+    { .name = "server", .has_arg = true, .flag = NULL, .val = 'W' },
+    { .name = "server-init", .has_arg = true, .flag = NULL, .val = 'T' },
+    { .name = "introspect", .has_arg = optional_argument, .flag = NULL,
+      .val = 'U' },
+    { .name = "uart", .has_arg = true, .flag = NULL, .val = 'u' },
+    { .name = "fastmem", .has_arg = false, .flag = NULL, .val = 'M' },
+    { .name = "counters", .has_arg = true, .flag = NULL, .val = 'J' },
+    { .name = "perf-counters", .has_arg = false, .flag = NULL, .val = 'O' },
+    { .name = "timer", .has_arg = true, .flag = NULL, .val = 'G' },
+    { .name = "isa", .has_arg = true, .flag = NULL, .val = 'i' },
+    { .name = "parallel-analysis", .has_arg = true, .flag = NULL,
+      .val = 'Q' },
     { .name = NULL, .has_arg = false, .flag = NULL, .val = 0 }
   };
   int c;
@@ -77,6 +228,40 @@ int main(int argc, char * const * argv) {
   const auto parse_number1 = [&](const char * start) {
     return parse_number(start, start + strlen(start));
   };
+  const auto parse_decimal = [&]() {
+    unsigned res;
+    if(std::from_chars(optarg, optarg + strlen(optarg), res).ec != std::errc{})
+      bad_number();
+    return res;
+  };
+  const auto parse_decimals = [&](std::vector<unsigned>& res) {
+    const char * cur = optarg;
+    const char * const end = optarg + strlen(optarg);
+    while(true) {
+      unsigned value;
+      const auto [next, ec] = std::from_chars(cur, end, value);
+      if(ec != std::errc{}) bad_number();
+      res.push_back(value);
+      if(next == end) break;
+      if(*next != ',') bad_number();
+      cur = next + 1;
+    }
+  };
+  const auto power_of_two = [](unsigned value) {
+    return value != 0 && (value & (value - 1)) == 0;
+  };
+  const auto parse_cache = [&]() {
+    std::vector<unsigned> args;
+    parse_decimals(args);
+    if(args.size() != 3 || !power_of_two(args[1]) || !power_of_two(args[2])
+       || args[2] < 4 || args[0] % (args[1]*args[2]) != 0
+       || !power_of_two(args[0] / (args[1]*args[2]))) {
+      std::cerr << "--" << opts[longindex].name
+		<< " needs SIZE,WAYS,LINE with a power-of-two number of sets\n";
+      std::exit(-1);
+    }
+    return cache_model{args[0], args[1], args[2]};
+  };
   const auto parse_comma = [&]() {
     const char * const comma = std::strchr(optarg, ',');
     if(!comma) no_comma();
@@ -84,6 +269,8 @@ int main(int argc, char * const * argv) {
     return std::pair{value, comma + 1};
   };
   std::vector<std::pair<uint32_t, const char*>> memories, ROMs;
+  std::vector<std::tuple<std::string, uint32_t, const char*>> shms;
+  std::vector<std::pair<uint32_t, uint32_t>> reset_vectors;
   while((c = getopt_long(argc, argv, "s:m:r:b:", opts, &longindex)) != -1) {
     switch(c) {
     case 's':
@@ -98,6 +285,173 @@ int main(int argc, char * const * argv) {
     case 't':
       ticks_base = parse_number1(optarg);
       break;
+    case 'd':
+      dma_base = parse_number1(optarg);
+      break;
+    case 'f':
+      host_files_base = parse_number1(optarg);
+      break;
+    case 'p':
+      profile_name = optarg;
+      break;
+    case 'F':
+      folded_name = optarg;
+      break;
+    case 'H':
+      profile_hz = parse_decimal();
+      break;
+    case 'c':
+      ncpus = parse_decimal();
+      if(ncpus == 0) bad_number();
+      break;
+    case 'v':
+      { const auto [index, addr] = parse_comma();
+	reset_vectors.push_back({index, parse_number1(addr)});
+      }
+      break;
+    case 'x':
+      semaphores_base = parse_number1(optarg);
+      break;
+    case 'e':
+      elf_name = optarg;
+      break;
+    case 'S':
+      { const char * const comma = std::strchr(optarg, ',');
+	if(!comma) no_comma();
+	const char * const comma2 = std::strchr(comma + 1, ',');
+	if(!comma2) no_comma();
+	shms.push_back({std::string(optarg, comma - optarg),
+			parse_number(comma + 1, comma2), comma2 + 1});
+      }
+      break;
+    case 'D':
+      doorbell_base = parse_number1(optarg);
+      break;
+    case 'l':
+      check_lockstep = true;
+      break;
+    case 'I':
+      icache.emplace(parse_cache());
+      break;
+    case 'C':
+      dcache.emplace(parse_cache());
+      break;
+    case 'P':
+      { const char * const comma = std::strchr(optarg, ',');
+	if(!comma) no_comma();
+	const std::string_view kind{optarg, comma};
+	unsigned entries;
+	if(std::from_chars(comma + 1, comma + strlen(comma), entries).ec
+	   != std::errc{} || !power_of_two(entries))
+	  bad_number();
+	if(kind != "bimodal" && kind != "gshare") {
+	  std::cerr << "unknown branch predictor: " << kind << '\n';
+	  return -1;
+	}
+	bpred.emplace(entries, kind == "gshare");
+      }
+      break;
+    case 'A':
+      analysis_name = optarg;
+      break;
+    case 'Q':
+      { std::vector<unsigned> args;
+	parse_decimals(args);
+	if(args.size() > 2 || args[0] == 0
+	   || (args.size() == 2 && args[1] == 0))
+	  bad_number();
+	sample_interval = args[0];
+	if(args.size() == 2) sample_jobs = args[1];
+      }
+      break;
+    case 'y':
+      { auto script = std::make_unique<std::ifstream>(optarg);
+	if(!*script) {
+	  std::cerr << "cannot open " << optarg << " for reading\n";
+	  return -3;
+	}
+	cpu.debug_script(std::move(script));
+      }
+      break;
+    case 'L':
+      plugin_specs.push_back(optarg);
+      break;
+    case 'g':
+      { const auto [base, size] = parse_comma();
+	const char * const end = size + strlen(size);
+	const auto [x, ec] = std::from_chars(size, end, framebuffer_width);
+	if(ec != std::errc{} || *x != 'x'
+	   || std::from_chars(x + 1, end, framebuffer_height).ec != std::errc{}
+	   || framebuffer_width == 0 || framebuffer_height == 0
+	   || std::uint64_t{framebuffer_width}*framebuffer_height >= 1u << 30)
+	  bad_number();
+	framebuffer_base = base;
+      }
+      break;
+    case 'o':
+      framebuffer_name = optarg;
+      break;
+    case 'k':
+      if(std::strcmp(optarg, "ppm") == 0) framebuffer_ppm = true;
+      else if(std::strcmp(optarg, "raw") == 0) framebuffer_ppm = false;
+      else {
+	std::cerr << "unknown framebuffer format: " << optarg << '\n';
+	return -1;
+      }
+      break;
+    case 'q':
+      framebuffer_fps = parse_decimal();
+      if(framebuffer_fps == 0) bad_number();
+      break;
+    case 'R':
+      recording = true;
+      record_name = optarg;
+      break;
+    case 'Y':
+      recording = true;
+      replay_name = optarg;
+      break;
+    case 'K':
+      checkpoint_interval = parse_decimal();
+      if(checkpoint_interval == 0) bad_number();
+      break;
+    case 'N':
+      max_checkpoints = parse_decimal();
+      if(max_checkpoints < 2) bad_number();
+      break;
+    case 'W':
+      server_name = optarg;
+      break;
+    case 'T':
+      init_point = parse_number1(optarg);
+      break;
+    case 'U':
+      introspect = true;
+      control_name = optarg;
+      break;
+    case 'u':
+      uart_specs.push_back(parse_comma());
+      break;
+    case 'M':
+      fastmem = true;
+      break;
+    case 'J':
+      counters_base = parse_number1(optarg);
+      break;
+    case 'O':
+      host_events = true;
+      break;
+    case 'G':
+      timer_base = parse_number1(optarg);
+      break;
+    case 'i':
+      if(std::strcmp(optarg, "ext") == 0) extended_isa = true;
+      else if(std::strcmp(optarg, "base") == 0) extended_isa = false;
+      else {
+	std::cerr << "unknown instruction set: " << optarg << '\n';
+	return -1;
+      }
+      break;
     case 'b':
       cpu.add_breakpoint(parse_number1(optarg));
       break;
@@ -108,20 +462,200 @@ int main(int argc, char * const * argv) {
       return -1;
     }
   }
+  if(fastmem) {
+    // Memory shared with the window would be shared between jobs.
+    if(server_name) {
+      std::cerr << "--fastmem cannot be used with --server\n";
+      return -1;
+    }
+    reserve_fastmem();
+  }
   for(const auto& args : memories)
     new memory(args.first, parse_number1(args.second));
+  shared_memory * shm = nullptr;
+  for(const auto& [name, base, limit] : shms)
+    shm = new shared_memory(name.c_str(), base, parse_number1(limit));
   for(const auto& args : ROMs) {
     const auto [fd, limit] = open_ROM(args.second);
     device * const start = get_device(args.first);
     device * const end = get_device(args.first + limit);
     if(start == end && typeid(*start) == typeid(memory)) {
       const auto mem = static_cast<memory*>(start);
-      mem->shadow_ROM(args.first - mem->get_base(), fd, limit);
+      mem->shadow_ROM(args.first - mem->get_base(), fd, limit, 0);
       close(fd);
     }
     else new mmap_ROM(fd, args.first, limit);
   }
-  if(stdio_base) new stdio(*stdio_base);
+  if(elf_name) cpu.set_reset_vector(load_elf(elf_name));
+  // Jobs are forked, so they must not share host files or sockets.
+  if(server_name && framebuffer_base) {
+    std::cerr << "--server cannot be used with --framebuffer\n";
+    return -1;
+  }
+  if(server_name && !uart_specs.empty()) {
+    std::cerr << "--server cannot be used with --uart\n";
+    return -1;
+  }
+  if(server_name && control_name) {
+    std::cerr << "--server cannot be used with a --introspect socket\n";
+    return -1;
+  }
+  stdio * console = nullptr;
+  if(stdio_base) console = new stdio(*stdio_base, !server_name);
+  for(const auto& [base, name] : uart_specs) {
+    const int fd = open_uart(name);
+    new uart(base, fd, fd);
+  }
   if(ticks_base) new ticks(*ticks_base);
+  if(dma_base) new dma(*dma_base);
+  // Device models waiting on guest time or host I/O run on CPU 0.
+  scheduler sched;
+  if(host_files_base) new host_files(*host_files_base, &sched);
+  if(timer_base) new timer(*timer_base, sched);
+  if(host_files_base || timer_base) cpu.drive(sched);
+  if(semaphores_base) new semaphores(*semaphores_base, ncpus);
+  if(counters_base) new perf_counters(*counters_base, ncpus);
+  if(doorbell_base) {
+    if(!shm) {
+      std::cerr << "no --shm region for the doorbell\n";
+      return -1;
+    }
+    new doorbell(*doorbell_base, *shm);
+  }
+  if(framebuffer_base) {
+    if(!framebuffer_name) {
+      std::cerr << "no --framebuffer-output given\n";
+      return -1;
+    }
+    const int fd = open(framebuffer_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd == -1) {
+      std::cerr << "cannot open " << framebuffer_name << " for writing: ";
+      std::perror("");
+      return -3;
+    }
+    new framebuffer(*framebuffer_base, framebuffer_width, framebuffer_height,
+		    fd, framebuffer_ppm, framebuffer_fps);
+  }
+  std::vector<std::unique_ptr<CPU>> secondary;
+  for(unsigned i = 1; i < ncpus; i++)
+    secondary.push_back(std::make_unique<CPU>(i));
+  for(const auto& [index, addr] : reset_vectors) {
+    if(index >= ncpus) {
+      std::cerr << "no CPU " << index << " to set the reset vector of\n";
+      return -1;
+    }
+    (index == 0 ? cpu : *secondary[index - 1]).set_reset_vector(addr);
+  }
+  if(counters_base) {
+    cpu.count_accesses();
+    for(const auto& other : secondary) other->count_accesses();
+  }
+  for(const char * spec : plugin_specs) load_plugin(spec);
+  attach_plugins(cpu, 0);
+  for(unsigned i = 1; i < ncpus; i++) attach_plugins(*secondary[i - 1], i);
+  lockstep checker;
+  if(check_lockstep) {
+    if(ncpus > 1) {
+      std::cerr << "--lockstep needs a single CPU\n";
+      return -1;
+    }
+    cpu.observe(checker);
+  }
+  std::optional<input_log> log;
+  std::optional<recorder> rec;
+  if(recording) {
+    if(ncpus > 1) {
+      std::cerr << "--record and --replay need a single CPU\n";
+      return -1;
+    }
+    // Checkpoints cover neither host files nor the timer.
+    if(host_files_base || timer_base) {
+      std::cerr << "--record and --replay cannot be used with "
+		<< (host_files_base ? "--host-files" : "--timer") << '\n';
+      return -1;
+    }
+    std::FILE * const replay =
+      replay_name ? std::fopen(replay_name, "rb") : NULL;
+    if(replay_name && !replay) {
+      std::cerr << "cannot open " << replay_name << " for reading: ";
+      std::perror("");
+      return -3;
+    }
+    std::FILE * const record =
+      record_name ? std::fopen(record_name, "wb") : NULL;
+    if(record_name && !record) {
+      std::cerr << "cannot open " << record_name << " for writing: ";
+      std::perror("");
+      return -3;
+    }
+    log.emplace(replay, record);
+    if(replay) std::fclose(replay);
+    inputs = &*log;
+    rec.emplace(cpu, *log, checkpoint_interval, max_checkpoints);
+    cpu.record(*rec);
+  }
+  if(server_name) {
+    if(init_point) cpu.run_to(*init_point);
+    serve(server_name);
+    if(console) console->start();
+  }
+  else if(init_point) {
+    std::cerr << "--server-init needs --server\n";
+    return -1;
+  }
+  if((icache || dcache || bpred) && ncpus > 1) {
+    std::cerr << "--icache, --dcache and --bpred need a single CPU\n";
+    return -1;
+  }
+  analysis * sampled = nullptr;
+  if(sample_interval) {
+    // Workers are forked, so nothing they change may be shared.
+    const std::pair<bool, const char*> conflicts[] = {
+      {recording, "--record or --replay"}, {server_name != NULL, "--server"},
+      {fastmem, "--fastmem"}, {shm != nullptr, "--shm"},
+      {host_files_base.has_value(), "--host-files"}
+    };
+    for(const auto& [conflict, what] : conflicts)
+      if(conflict) {
+	std::cerr << "--parallel-analysis cannot be used with " << what
+		  << '\n';
+	return -1;
+      }
+    if(!icache && !dcache && !bpred) {
+      std::cerr << "--parallel-analysis needs --icache, --dcache or --bpred\n";
+      return -1;
+    }
+    sampled = &start_analysis(cpu, std::move(icache), std::move(dcache),
+			      std::move(bpred), analysis_name, false);
+  }
+  else if(icache || dcache || bpred)
+    start_analysis(cpu, std::move(icache), std::move(dcache), std::move(bpred),
+		   analysis_name);
+  if(introspect) {
+    std::vector<CPU*> cpus{&cpu};
+    for(const auto& other : secondary) cpus.push_back(other.get());
+    start_introspection(std::move(cpus), control_name);
+  }
+  if(profile_name || folded_name)
+    start_profile(cpu, profile_hz, profile_name, folded_name);
+  if(fastmem) map_fastmem();
+  if(host_events) count_host_events(cpu, 0);
+  if(sampled)
+    start_sampling(cpu, sched, *sampled, sample_interval, sample_jobs);
+  all_cpus.push_back(&cpu);
+  for(const auto& other : secondary) all_cpus.push_back(other.get());
+  main_thread = std::this_thread::get_id();
+  std::atexit(stop_cpus);
+  for(unsigned i = 1; i < ncpus; i++)
+    cpu_threads.emplace_back([&other = *secondary[i - 1], i, host_events]() {
+      if(host_events) count_host_events(other, i);
+      other.execute();
+    });
   cpu.execute();
+  // The exit handlers still use the CPUs.
+  CPU::halt(0);
+  // Another thread is exiting, and waits for CPU 0 to stop.
+  main_stopped.store(true);
+  main_stopped.notify_all();
+  while(true) pause();
 }
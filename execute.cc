@@ -1,7 +1,14 @@
 #include "cpu.h"
 #include "device.h"
+#include "fastmem.h"
+#include "scheduler.h"
+#include "isa.h"
 #include "emulate.h"
 #include <iostream>
+#include <utility>
+#include <optional>
+#include <algorithm>
+#include <iterator>
 #include <cassert>
 
 using std::uint32_t;
@@ -187,18 +194,36 @@ using std::uint16_t;
     NULLARY0_CASES(LOADI)			\
     NULLARY0_CASES(CALL)			\
     NULLARY0_CASES(LOADI16)			\
-    NULLARY0_CASES(LOADI16H)
+    NULLARY0_CASES(LOADI16H)			\
+    NULLARY0_CASES(SHL)				\
+    NULLARY0_CASES(SHR)				\
+    NULLARY0_CASES(SAR)				\
+    NULLARY0_CASES(MUL)				\
+    NULLARY0_CASES(MULH)			\
+    NULLARY0_CASES(MULHU)			\
+    NULLARY0_CASES(DIV)				\
+    NULLARY0_CASES(DIVU)			\
+    NULLARY0_CASES(REM)				\
+    NULLARY0_CASES(REMU)			\
+    UNARY0_CASES(LOADB)				\
+    UNARY0_CASES(LOADBS)			\
+    UNARY0_CASES(LOADH)				\
+    UNARY0_CASES(LOADHS)			\
+    UNARY0_CASES(STOREB)			\
+    UNARY0_CASES(STOREH)
 
 #ifdef __GNUC__
 
 #  define GOTO_NEXT_INST			\
-  if(inst > make_inst(OPCODES, 7, 7, 7, -1))	\
+  if(inst > last_inst)				\
     goto invalid;				\
   goto *labels[inst >> 17];
 
 #else
 
 #  define GOTO_NEXT_INST			\
+  if(inst > last_inst)				\
+    goto invalid;				\
   switch(inst >> 17) {				\
     ALL_CASES					\
   default:					\
@@ -213,15 +238,82 @@ using std::uint16_t;
 #  define USE(reg)
 #endif
 
-#define FIRST_INST					\
-  inst = get(lrc, lrb, lrl, pc);			\
-  maybe_single_step(single_step, pc, inst, REGS);	\
+#define FIRST_INST							\
+  inst = GET(pc);							\
+  if constexpr(instrumented) {						\
+    if(retired == stop_at) [[unlikely]] single_step = true;		\
+    if(events & observer::instructions) obs->instruction(pc, inst);	\
+  }									\
+  if(maybe_single_step(single_step, pc, inst, REGS)) [[unlikely]] return; \
+  if constexpr(instrumented) retired++;					\
   GOTO_NEXT_INST
 
 #define NEXT_INST				\
   pc += 4;					\
   FIRST_INST
 
+/* Unless the CPU is observed throughout, a block runs in the instrumented
+   engine only if the observers ask for events on entering it.  The engine
+   returns for execute to carry on in the other one, passing on the events
+   so that the observers are told about the block once. */
+#define SWITCH_ENGINE							\
+  if constexpr(instrumented) {						\
+    if(!events && !this->instrumented) {				\
+      entered = events;							\
+      resume = cpu_state{pc + 4, {REGS}, Z, N, cmp};			\
+      return;								\
+    }									\
+  }									\
+  else if(obs) [[unlikely]] {						\
+    events = obs->block(cpu_state{pc + 4, {REGS}, Z, N, cmp});		\
+    if(events) {							\
+      entered = events;							\
+      resume = cpu_state{pc + 4, {REGS}, Z, N, cmp};			\
+      return;								\
+    }									\
+  }
+
+/* Control transfers end a block.  pc still points at the transfer (or at the
+   target less 4), so the next block starts at pc + 4. */
+#define END_BLOCK							\
+  block_start = pc + 4;							\
+  current_block.store(pc + 4, std::memory_order_relaxed);		\
+  published_retired.store(retired, std::memory_order_relaxed);		\
+  if(counting) [[unlikely]] publish_counts();				\
+  if(sched && retired >= sched->due()) [[unlikely]]			\
+    sched->advance(retired);						\
+  if constexpr(instrumented)						\
+    if(obs) events = obs->block(cpu_state{pc + 4, {REGS}, Z, N, cmp}); \
+  if(interrupted.load(std::memory_order_relaxed)) [[unlikely]] {	\
+    if(!restarting) return;						\
+    restarting = false;							\
+    interrupted.store(false, std::memory_order_relaxed);		\
+    if constexpr(!instrumented) {					\
+      resume = cpu_state{pc + 4, {REGS}, Z, N, cmp};			\
+      return;								\
+    }									\
+  }									\
+  SWITCH_ENGINE
+
+/* The uninstrumented engine counts the instructions of a block as the
+   control transfer ending it starts, before pc moves, and both engines count
+   its loads and stores then. */
+#define BLOCK_DONE							\
+  if constexpr(!instrumented) retired += ((pc - block_start) >> 2) + 1;	\
+  if(counting) [[unlikely]] count_block(block_start, pc);
+
+/* Counts a control transfer taken. */
+#define TAKEN					\
+  if(counting) [[unlikely]] taken++;
+
+/* Counts an access made through the device table rather than the contents
+   of the largest devices. */
+#define SLOW_ACCESS(addr)				\
+  if(counting) [[unlikely]] {				\
+    slow_accesses++;					\
+    device_accesses += !get_device(addr)->is_array();	\
+  }
+
 [[gnu::always_inline]]
 static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 			   std::uint32_t lrl, uint32_t addr) {
@@ -230,6 +322,10 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
   else return get_word(addr);
 }
 
+/* Loads a word, through the fastmem window in the direct engine. */
+#define GET(addr)							\
+  (direct ? fastmem_get(window, addr) : get(lrc, lrb, lrl, addr))
+
 #define BINARY3(rd, rs1, rs2, label, op)	\
   label##rd##rs1##rs2:				\
   r##rd = r##rs1 op r##rs2;			\
@@ -244,6 +340,23 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 #define BINARY0(label, op)			\
   EXHAUST5(BINARY1, label, op)
 
+/* The extension operations are specialised on the destination only, and
+   read their operands by number: specialising them on all three registers
+   like the base ones makes this file take many times as long to compile. */
+static inline uint32_t reg_value(int n, REGS_PARAMS) {
+  const uint32_t regs[] = {REGS};
+  return regs[n];
+}
+
+#define EXTENDED1(rd, label, fn)					\
+  label##rd:								\
+  r##rd = fn(reg_value(inst_rs1(inst), REGS),				\
+	     reg_value(inst_rs2(inst), REGS));				\
+  NEXT_INST
+
+#define EXTENDED0(label, fn)			\
+  EXHAUST3(EXTENDED1, label, fn)
+
 #define NOT2(rd, rs1)				\
   NOT##rd##rs1:					\
   r##rd = ~r##rs1;				\
@@ -255,9 +368,19 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 #define NOT0()					\
   EXHAUST4(NOT1)
 
-#define LOAD2(rd, rs2)				\
-  LOAD##rd##rs2:				\
-  r##rd = get(lrc, lrb, lrl, r##rs2 + imm);	\
+#define LOAD2(rd, rs2)							\
+  LOAD##rd##rs2:							\
+  { const uint32_t src = r##rs2 + imm;					\
+    if constexpr(direct) r##rd = fastmem_get(window, src);		\
+    else if(word_in_range(src, lrb, lrl) && lrc) [[likely]]		\
+      r##rd = get_word_raw(lrc, lrl, src - lrb);			\
+    else {								\
+      SLOW_ACCESS(src);							\
+      r##rd = get_word(src);						\
+    }									\
+    if constexpr(instrumented)						\
+      if(events & observer::accesses) obs->load(src, r##rd, 4);		\
+  }									\
   NEXT_INST
 
 #define LOAD1(rs2)				\
@@ -269,9 +392,15 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 #define STORE2(rd, rs2)							\
   STORE##rd##rs2:							\
   { const uint32_t dest = r##rs2 + imm;					\
-    if(word_in_range(dest, lmb, lml) && lmc)				\
-      [[likely]] set_word_raw(lmc, lml, dest - lmb, r##rd);		\
-    else set_word(dest, r##rd);						\
+    if constexpr(instrumented)						\
+      if(events & observer::accesses) obs->store(dest, r##rd, 4);	\
+    if constexpr(direct) fastmem_set(window, dest, r##rd);		\
+    else if(word_in_range(dest, lmb, lml) && lmc) [[likely]]		\
+      set_word_raw(lmc, lml, dest - lmb, r##rd);			\
+    else {								\
+      SLOW_ACCESS(dest);						\
+      set_word(dest, r##rd);						\
+    }									\
   }									\
   NEXT_INST
 
@@ -281,9 +410,61 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 #define STORE0()				\
   EXHAUST4(STORE1)
 
+/* Bytes and halfwords are accessed in the largest devices or through the
+   devices a byte at a time, even in the direct engine: the fastmem window
+   maps the same contents. */
+#define LOAD_NARROW2(rd, rs2, label, type)				\
+  label##rd##rs2:							\
+  { const uint32_t src = r##rs2 + imm;					\
+    constexpr unsigned size = sizeof(type);				\
+    uint32_t value;							\
+    if(narrow_in_range(src, size, lrb, lrl) && lrc) [[likely]]		\
+      value = get_narrow_raw(lrc, src - lrb, size);			\
+    else {								\
+      SLOW_ACCESS(src);							\
+      value = get_narrow(src, size);					\
+    }									\
+    r##rd = static_cast<type>(value);					\
+    if constexpr(instrumented)						\
+      if(events & observer::accesses) obs->load(src, value, size);	\
+  }									\
+  NEXT_INST
+
+#define LOAD_NARROW1(rs2, label, type)		\
+  EXHAUST3(LOAD_NARROW2, rs2, label, type)
+
+#define LOAD_NARROW0(label, type)		\
+  EXHAUST4(LOAD_NARROW1, label, type)
+
+#define STORE_NARROW2(rd, rs2, label, size)				\
+  label##rd##rs2:							\
+  { const uint32_t dest = r##rs2 + imm;					\
+    const uint32_t value = r##rd & 0xFFFFFFFF >> (4 - (size))*8;	\
+    if constexpr(instrumented)						\
+      if(events & observer::accesses) obs->store(dest, value, size);	\
+    if(narrow_in_range(dest, size, lmb, lml) && lmc) [[likely]]		\
+      set_narrow_raw(lmc, dest - lmb, size, value);			\
+    else {								\
+      SLOW_ACCESS(dest);						\
+      set_narrow(dest, size, value);					\
+    }									\
+  }									\
+  NEXT_INST
+
+#define STORE_NARROW1(rs2, label, size)		\
+  EXHAUST3(STORE_NARROW2, rs2, label, size)
+
+#define STORE_NARROW0(label, size)		\
+  EXHAUST4(STORE_NARROW1, label, size)
+
 #define BRANCH1(rs2)				\
   BRANCH##rs2:					\
-  if(!r##rs2) pc += imm;			\
+  BLOCK_DONE					\
+  if(!r##rs2) {					\
+    pc += imm;					\
+    TAKEN					\
+  }						\
+  END_BLOCK					\
   NEXT_INST
 
 #define BRANCH0()				\
@@ -304,8 +485,12 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 
 #define BCC1(rs2, label, cond, pred)		\
   label##rs2:					\
-  if(cmp ? (cond) : r##rs2 pred)		\
+  BLOCK_DONE					\
+  if(cmp ? (cond) : r##rs2 pred) {		\
     pc += imm;					\
+    TAKEN					\
+  }						\
+  END_BLOCK					\
   NEXT_INST
 
 #define BCC0(label, cond, pred)			\
@@ -313,8 +498,12 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 
 #define BGT1(rs2)				\
   BGT##rs2:					\
-  if(cmp ? !N && !Z : !(r##rs2 & 0x80000000))	\
+  BLOCK_DONE					\
+  if(cmp ? !N && !Z : !(r##rs2 & 0x80000000)) {	\
     pc += imm;					\
+    TAKEN					\
+  }						\
+  END_BLOCK					\
   NEXT_INST
 
 #define BGT0()					\
@@ -330,7 +519,10 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 
 #define CALL1(rd)				\
   CALL##rd:					\
+  BLOCK_DONE					\
   pc = r##rd - 4;				\
+  TAKEN						\
+  END_BLOCK					\
   NEXT_INST
 
 #define CALL0()					\
@@ -347,9 +539,37 @@ static inline uint32_t get(std::uint32_t * lrc, std::uint32_t lrb,
 #define LOADI16HW0(HW, mask, lop)			\
   EXHAUST3(LOADI16HW1, HW, mask, lop)
 
-void CPU::execute() {
-  uint32_t pc = 0;
-  bool single_step = false;
+template<bool instrumented, bool direct>
+#ifdef __GNUC__
+[[gnu::noinline, gnu::noclone]]
+#endif
+void CPU::run() {
+  const cpu_state start = resume.value_or(cpu_state{reset_vector, {}, Z, N,
+						     cmp});
+  resume.reset();
+  uint32_t pc = start.pc;
+  uint32_t block_start = pc;
+  const bool counting = count_cache != nullptr;
+  if constexpr(direct)
+    if(counting) {
+      fastmem_slow_accesses = &slow_accesses;
+      fastmem_device_accesses = &device_accesses;
+    }
+  Z = start.Z;
+  N = start.N;
+  cmp = start.cmp;
+  unsigned events = 0;
+  if(obs) {
+    events = entered ? *entered : obs->block(start);
+    entered.reset();
+    if constexpr(!instrumented)
+      if(events) {
+	entered = events;
+	resume = start;
+	return;
+      }
+  }
+  bool single_step = std::exchange(stop_at_start, false);
   array_device * const lr = largest_readable;
   std::uint32_t * const lrc = lr ? lr->get_contents() : nullptr;
   const std::uint32_t lrb = lr ? lr->get_base() : 0;
@@ -358,22 +578,32 @@ void CPU::execute() {
   std::uint32_t * const lmc = lm ? lm->get_contents() : nullptr;
   const std::uint32_t lmb = lm ? lm->get_base() : 0;
   const std::uint32_t lml = lm ? lm->get_limit() : 0;
+  [[maybe_unused]] char * const window = fastmem_window;
+  // The extension opcodes all come after the base ones.
+  const uint32_t last_inst =
+    make_inst(extended_isa ? OPCODES : OP_LOADI16H, 7, 7, 7, -1);
 
 #ifdef __GNUC__
-  void * labels[(OPCODES + 1) << 9];
-  ALL_CASES;
+  /* Filled once, so that switching engines between blocks is cheap.  run is
+     neither inlined nor cloned, so the labels keep their addresses. */
+  static void * labels[(OPCODES + 1) << 9];
+  [[maybe_unused]] static const bool filled = ({
+      std::fill(std::begin(labels), std::end(labels), &&invalid);
+      ALL_CASES;
+      true;
+    });
 #endif
 
   uint32_t inst;
 #define imm (inst_imm(inst))
-  uint32_t r0 = 0;
-  uint32_t r1 = 0;
-  uint32_t r2 = 0;
-  uint32_t r3 = 0;
-  uint32_t r4 = 0;
-  uint32_t r5 = 0;
-  uint32_t r6 = 0;
-  uint32_t r7 = 0;
+  uint32_t r0 = start.regs[0];
+  uint32_t r1 = start.regs[1];
+  uint32_t r2 = start.regs[2];
+  uint32_t r3 = start.regs[3];
+  uint32_t r4 = start.regs[4];
+  uint32_t r5 = start.regs[5];
+  uint32_t r6 = start.regs[6];
+  uint32_t r7 = start.regs[7];
 
   FIRST_INST;
 
@@ -387,7 +617,10 @@ void CPU::execute() {
   STORE0();
 
  JUMP:
+  BLOCK_DONE;
   pc += imm;
+  TAKEN;
+  END_BLOCK;
   NEXT_INST;
 
   BRANCH0();
@@ -400,8 +633,69 @@ void CPU::execute() {
   CALL0();
   LOADI16HW0(, 0xFFFF0000, & 0xFFFF);
   LOADI16HW0(H, 0xFFFF, << 16);
+  EXTENDED0(SHL, isa::shl);
+  EXTENDED0(SHR, isa::shr);
+  EXTENDED0(SAR, isa::sar);
+  EXTENDED0(MUL, isa::mul);
+  EXTENDED0(MULH, isa::mulh);
+  EXTENDED0(MULHU, isa::mulhu);
+  EXTENDED0(DIV, isa::div);
+  EXTENDED0(DIVU, isa::divu);
+  EXTENDED0(REM, isa::rem);
+  EXTENDED0(REMU, isa::remu);
+  LOAD_NARROW0(LOADB, std::uint8_t);
+  LOAD_NARROW0(LOADBS, std::int8_t);
+  LOAD_NARROW0(LOADH, std::uint16_t);
+  LOAD_NARROW0(LOADHS, std::int16_t);
+  STORE_NARROW0(STOREB, 1);
+  STORE_NARROW0(STOREH, 2);
  invalid:
+  /* Neither engine counts the invalid instruction, so that retired is where
+     the program stopped. */
+  if constexpr(instrumented) retired--;
+  else retired += (pc - block_start) >> 2;
   std::cerr << "invalid opcode\n";
-  exit(-2);
+  halt(-2);
 #undef imm
 }
+
+void CPU::run_to(uint32_t addr) {
+  struct stop final : public observer {
+    CPU& cpu;
+    const uint32_t addr;
+    std::optional<cpu_state> state;
+
+    stop(CPU& cpu, uint32_t addr) : cpu{cpu}, addr{addr} {}
+
+    unsigned block(const cpu_state& entered) override {
+      if(entered.pc == addr && !state) {
+	state = entered;
+	cpu.interrupt();
+      }
+      return 0;
+    }
+  } stop{*this, addr};
+  current_cpu = id;
+  current_counts = &counts;
+  observer * const observing = std::exchange(obs, &stop);
+  const bool was_instrumented = std::exchange(instrumented, true);
+  entered.reset();
+  run<true>();
+  obs = observing;
+  instrumented = was_instrumented;
+  interrupted.store(false, std::memory_order_relaxed);
+  resume = stop.state;
+}
+
+void CPU::execute() {
+  current_cpu = id;
+  current_counts = &counts;
+  do {
+    if(instrumented || entered.value_or(0)) {
+      if(fastmem_window) run<true, true>();
+      else run<true>();
+    }
+    else if(fastmem_window) run<false, true>();
+    else run<false>();
+  } while(resume);
+}
@@ -0,0 +1,134 @@
+#include "fastmem.h"
+#include "device.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
+#include <iostream>
+#include <typeinfo>
+#include <cstdio>
+#include <cstdlib>
+
+using std::uint32_t;
+using std::uint64_t;
+
+char * fastmem_window = nullptr;
+thread_local uint64_t * fastmem_slow_accesses = nullptr;
+thread_local uint64_t * fastmem_device_accesses = nullptr;
+
+static constexpr uint64_t window_size = uint64_t{1} << 32;
+
+#if defined(__x86_64__) && defined(__linux__)
+
+/* The instructions fastmem_get and fastmem_set assemble to, movl (%rdx),
+   %eax and movl %eax, (%rdx). */
+static constexpr unsigned char load_inst[] = { 0x8B, 0x02 };
+static constexpr unsigned char store_inst[] = { 0x89, 0x02 };
+
+static void fault_handler(int, siginfo_t * info, void * context) {
+  greg_t * const regs = static_cast<ucontext_t*>(context)->uc_mcontext.gregs;
+  const auto inst = reinterpret_cast<const unsigned char*>(regs[REG_RIP]);
+  const auto host = reinterpret_cast<char*>(regs[REG_RDX]);
+  const auto fault = static_cast<char*>(info->si_addr);
+  const long pagesize = sysconf(_SC_PAGESIZE);
+  if(host >= fastmem_window && host < fastmem_window + window_size
+     && fault >= host && fault < fastmem_window + window_size + pagesize) {
+    const uint32_t addr = host - fastmem_window;
+    if(fastmem_slow_accesses) {
+      ++*fastmem_slow_accesses;
+      *fastmem_device_accesses += !get_device(addr)->is_array();
+    }
+    if(std::memcmp(inst, load_inst, sizeof(load_inst)) == 0) {
+      regs[REG_RAX] = get_word(addr);
+      regs[REG_RIP] += sizeof(load_inst);
+      return;
+    }
+    if(std::memcmp(inst, store_inst, sizeof(store_inst)) == 0) {
+      set_word(addr, static_cast<uint32_t>(regs[REG_RAX]));
+      regs[REG_RIP] += sizeof(store_inst);
+      return;
+    }
+  }
+  // Any other fault is a crash: retried without the handler, it reports as
+  // usual.
+  signal(SIGSEGV, SIG_DFL);
+}
+
+void reserve_fastmem() {
+  const long pagesize = sysconf(_SC_PAGESIZE);
+  const auto ptr = mmap(NULL, window_size + pagesize, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(ptr == MAP_FAILED) {
+    std::perror("cannot reserve the fastmem window");
+    std::exit(-3);
+  }
+  fastmem_window = static_cast<char*>(ptr);
+  backed_memory = true;
+  struct sigaction sa = {};
+  sa.sa_sigaction = fault_handler;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  if(sigaction(SIGSEGV, &sa, NULL) == -1) {
+    std::perror("cannot handle SIGSEGV");
+    std::exit(-3);
+  }
+}
+
+#else
+
+void reserve_fastmem() {
+  std::cerr << "--fastmem is only supported on x86-64 Linux\n";
+  std::exit(-1);
+}
+
+#endif
+
+/* The device serving the whole 4 KiB at the address, if a single one
+   does. */
+static device * chunk_device(uint32_t addr) {
+  return std::visit([&](const auto& val3) -> device* {
+    if constexpr(std::is_same_v<decltype(val3), device* const&>)
+      return val3;
+    else return std::visit([&](const auto& val2) -> device* {
+      if constexpr(std::is_same_v<decltype(val2), device* const&>)
+	return val2;
+      else return nullptr;
+    }, (*val3)[(addr >> 12) & 0x3FF]);
+  }, devtab[addr >> 22]);
+}
+
+/* The device that can be mapped at the host page at the address, if any. */
+static array_device * page_device(uint64_t addr, uint64_t pagesize) {
+  device * const dev = chunk_device(addr);
+  for(uint64_t off = 0x1000; off < pagesize; off += 0x1000)
+    if(chunk_device(addr + off) != dev) return nullptr;
+  array_device * const arr = dynamic_cast<array_device*>(dev);
+  if(!arr || arr->get_backing() == -1
+     || (arr->get_backing_offset() + addr - arr->get_base()) % pagesize != 0)
+    return nullptr;
+  return arr;
+}
+
+void map_fastmem() {
+  const uint64_t pagesize = sysconf(_SC_PAGESIZE);
+  uint64_t addr = 0;
+  while(addr < window_size) {
+    array_device * const dev = page_device(addr, pagesize);
+    uint64_t end = addr + pagesize;
+    if(!dev) {
+      addr = end;
+      continue;
+    }
+    while(end < window_size && page_device(end, pagesize) == dev)
+      end += pagesize;
+    const bool writable = dynamic_cast<memory*>(dev)
+      || typeid(*dev) == typeid(segment_device);
+    if(mmap(fastmem_window + addr, end - addr,
+	    writable ? PROT_READ | PROT_WRITE : PROT_READ,
+	    MAP_SHARED | MAP_FIXED, dev->get_backing(),
+	    dev->get_backing_offset() + addr - dev->get_base()) == MAP_FAILED) {
+      std::perror("cannot map memory into the fastmem window");
+      std::exit(-3);
+    }
+    addr = end;
+  }
+}
@@ -0,0 +1,55 @@
+// -*- C++ -*-
+#ifndef FASTMEM_H_
+#define FASTMEM_H_
+#include <cstdint>
+#include <cstring>
+
+/* The guest address space laid out in 4 GiB of host address space, followed
+   by a guard page, so that both engines access a word at window + addr with
+   a single host access.  Pages lying wholly in memory, shared memory, a ROM
+   or a segment are mapped there, ROMs read-only, and every other page is
+   left inaccessible: accessing it faults, and a SIGSEGV handler makes the
+   access through the devices instead and resumes after it.  Devices accessed
+   through the window are therefore much slower than with bounds checks, and
+   so is a ROM not filling its last page unless it is loaded into memory. */
+extern char * fastmem_window;
+
+/* Where the SIGSEGV handler counts the accesses it makes through the devices
+   for the CPU on the calling thread, and those reaching devices other than
+   array devices, or null if that CPU does not count them. */
+extern thread_local std::uint64_t * fastmem_slow_accesses;
+extern thread_local std::uint64_t * fastmem_device_accesses;
+
+/* Reserves the window and backs memory so that it can be mapped into it.
+   This must happen before any device is created.  Exits if the host is not
+   supported. */
+void reserve_fastmem();
+
+/* Maps the pages of the devices into the window, once they all exist. */
+void map_fastmem();
+
+/* The accesses are made by a single known instruction each, with the host
+   address and the word in known registers, for the SIGSEGV handler to
+   recognise and finish them. */
+[[gnu::always_inline]]
+inline std::uint32_t fastmem_get(char * window, std::uint32_t addr) {
+  std::uint32_t word;
+#if defined(__x86_64__) && defined(__GNUC__)
+  asm volatile("movl (%1), %0" : "=a"(word) : "d"(window + addr) : "memory");
+#else
+  std::memcpy(&word, window + addr, sizeof(word));
+#endif
+  return word;
+}
+
+[[gnu::always_inline]]
+inline void fastmem_set(char * window, std::uint32_t addr,
+			std::uint32_t word) {
+#if defined(__x86_64__) && defined(__GNUC__)
+  asm volatile("movl %0, (%1)" : : "a"(word), "d"(window + addr) : "memory");
+#else
+  std::memcpy(window + addr, &word, sizeof(word));
+#endif
+}
+
+#endif
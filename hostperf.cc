@@ -0,0 +1,107 @@
+#include "hostperf.h"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+
+using std::uint64_t;
+
+namespace {
+  struct event {
+    const char * name;
+    std::uint32_t type;
+    uint64_t config;
+  };
+
+  constexpr uint64_t cache_misses(uint64_t cache) {
+    return cache | PERF_COUNT_HW_CACHE_OP_READ << 8
+      | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+  }
+
+  constexpr std::array<event, 5> events = {{
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "branch mispredictions", PERF_TYPE_HARDWARE,
+      PERF_COUNT_HW_BRANCH_MISSES },
+    { "L1i misses", PERF_TYPE_HW_CACHE,
+      cache_misses(PERF_COUNT_HW_CACHE_L1I) },
+    { "iTLB misses", PERF_TYPE_HW_CACHE,
+      cache_misses(PERF_COUNT_HW_CACHE_ITLB) }
+  }};
+
+  /* The descriptor counting each event, or the error opening it as a
+     negative number. */
+  struct counted {
+    const CPU * cpu;
+    unsigned index;
+    std::array<int, events.size()> fds;
+  };
+
+  std::mutex counting_lock;
+  std::vector<counted> counting;
+}
+
+static int open_event(const event& ev) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = ev.type;
+  attr.config = ev.config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format =
+    PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  const long fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+			  PERF_FLAG_FD_CLOEXEC);
+  return fd == -1 ? -errno : fd;
+}
+
+/* Events are multiplexed if there are more than the host can count at once,
+   so counts are scaled up to the whole time they were enabled. */
+static void report() {
+  const std::lock_guard lock{counting_lock};
+  std::ostringstream out;
+  for(const counted& c : counting) {
+    const uint64_t guest = c.cpu->get_retired();
+    out << "cpu " << c.index << ": " << guest << " guest instructions\n";
+    for(std::size_t i = 0; i < events.size(); i++) {
+      out << "  " << events[i].name << ": ";
+      uint64_t values[3];
+      if(c.fds[i] < 0) {
+	out << "not counted (" << std::strerror(-c.fds[i]) << ")\n";
+	continue;
+      }
+      if(read(c.fds[i], values, sizeof(values)) != sizeof(values)
+	 || values[2] == 0) {
+	out << "not counted\n";
+	continue;
+      }
+      const double count = values[2] < values[1]
+	? static_cast<double>(values[0]) * values[1] / values[2]
+	: values[0];
+      out << static_cast<uint64_t>(count);
+      if(guest) out << ", " << count / guest << " per guest instruction";
+      if(values[2] < values[1]) out << " (scaled)";
+      out << '\n';
+    }
+  }
+  const std::string text = out.str();
+  [[maybe_unused]] const auto written = write(2, text.data(), text.size());
+}
+
+void count_host_events(const CPU& cpu, unsigned index) {
+  counted c{&cpu, index, {}};
+  for(std::size_t i = 0; i < events.size(); i++)
+    c.fds[i] = open_event(events[i]);
+  const std::lock_guard lock{counting_lock};
+  if(counting.empty()) std::atexit(report);
+  counting.push_back(c);
+}
@@ -0,0 +1,14 @@
+// -*- C++ -*-
+#ifndef HOSTPERF_H_
+#define HOSTPERF_H_
+#include "cpu.h"
+
+/* Counts host cycles, instructions, branch mispredictions, L1 instruction
+   cache misses and instruction TLB misses in user space on the calling
+   thread from now on, with perf_event_open, and reports them to stderr at
+   exit for the CPU with the given index, per guest instruction it has run.
+   The thread should go on to run only the CPU.  Events the host cannot count
+   are reported as such. */
+void count_host_events(const CPU&, unsigned);
+
+#endif
@@ -0,0 +1,48 @@
+/* Instruction names and classes shared by the disassembler and the
+   emulator. */
+#ifndef INST_H_
+#define INST_H_
+#include "emulate.h"
+#ifndef __cplusplus
+#include <stdbool.h>
+#endif
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The mnemonic of opcode, or "invalid" if it has none. */
+const char * op_name(enum opcode opcode);
+
+static inline bool is_branch(enum opcode opcode) {
+  switch(opcode) {
+  case OP_JUMP:
+  case OP_BRANCH:
+  case OP_BEQ:
+  case OP_BNE:
+  case OP_BLT:
+  case OP_BGT:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Whether the engines run opcode: the opcode between OP_CMP and OP_BEQ is
+   unassigned, and those after OP_LOADI16H belong to the extension. */
+static inline bool valid_opcode(enum opcode opcode, bool extended) {
+  return opcode <= (extended ? OPCODES : OP_LOADI16H)
+    && !(opcode > OP_CMP && opcode < OP_BEQ);
+}
+
+/* Whether inst ends a basic block, by transferring control or by stopping
+   the CPU as an invalid instruction. */
+static inline bool ends_block(uint32_t inst, bool extended) {
+  const enum opcode opcode = inst_opcode(inst);
+  return is_branch(opcode) || opcode == OP_CALL
+    || !valid_opcode(opcode, extended);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,134 @@
+#include "interpret.h"
+#include "emulate.h"
+#include "isa.h"
+
+using std::uint32_t;
+using std::int32_t;
+using std::int16_t;
+using std::int8_t;
+
+interpreter::result interpreter::step(cpu_state& state) {
+  const uint32_t inst = fetch(state.pc);
+  auto& rd = state.regs[inst_rd(inst)];
+  const uint32_t rs1 = state.regs[inst_rs1(inst)];
+  const uint32_t rs2 = state.regs[inst_rs2(inst)];
+  const uint32_t imm = inst_imm(inst);
+  bool taken = false;
+  if(inst_opcode(inst) > OP_LOADI16H && !extended_isa) return result::invalid;
+  switch(inst_opcode(inst)) {
+  case OP_ADD:
+    rd = rs1 + rs2;
+    break;
+  case OP_SUB:
+    rd = rs1 - rs2;
+    break;
+  case OP_AND:
+    rd = rs1 & rs2;
+    break;
+  case OP_OR:
+    rd = rs1 | rs2;
+    break;
+  case OP_XOR:
+    rd = rs1 ^ rs2;
+    break;
+  case OP_NOT:
+    rd = ~rs1;
+    break;
+  case OP_LOAD:
+    rd = read(rs2 + imm, 4);
+    break;
+  case OP_STORE:
+    write(rs2 + imm, rd, 4);
+    break;
+  case OP_JUMP:
+    state.pc += imm + 4;
+    return result::end_block;
+  case OP_BRANCH:
+    taken = !rs2;
+    goto branch;
+  case OP_CMP:
+    state.Z = rs1 == rs2;
+    state.N = static_cast<int32_t>(rs1) < static_cast<int32_t>(rs2);
+    state.cmp = true;
+    break;
+  case OP_BEQ:
+    taken = state.cmp ? state.Z : rs2 == 0;
+    goto branch;
+  case OP_BNE:
+    taken = state.cmp ? !state.Z : rs2 != 0;
+    goto branch;
+  case OP_BLT:
+    taken = state.cmp ? state.N : (rs2 & 0x80000000) != 0;
+    goto branch;
+  case OP_BGT:
+    taken = state.cmp ? !state.N && !state.Z : !(rs2 & 0x80000000);
+    goto branch;
+  case OP_LOADI:
+    rd = inst_loadi_imm(inst);
+    break;
+  case OP_CALL:
+    state.pc = rd;
+    return result::end_block;
+  case OP_LOADI16:
+    rd = (rd & 0xFFFF0000) | (imm & 0xFFFF);
+    break;
+  case OP_LOADI16H:
+    rd = (rd & 0xFFFF) | imm << 16;
+    break;
+  case OP_SHL:
+    rd = isa::shl(rs1, rs2);
+    break;
+  case OP_SHR:
+    rd = isa::shr(rs1, rs2);
+    break;
+  case OP_SAR:
+    rd = isa::sar(rs1, rs2);
+    break;
+  case OP_MUL:
+    rd = isa::mul(rs1, rs2);
+    break;
+  case OP_MULH:
+    rd = isa::mulh(rs1, rs2);
+    break;
+  case OP_MULHU:
+    rd = isa::mulhu(rs1, rs2);
+    break;
+  case OP_DIV:
+    rd = isa::div(rs1, rs2);
+    break;
+  case OP_DIVU:
+    rd = isa::divu(rs1, rs2);
+    break;
+  case OP_REM:
+    rd = isa::rem(rs1, rs2);
+    break;
+  case OP_REMU:
+    rd = isa::remu(rs1, rs2);
+    break;
+  case OP_LOADB:
+    rd = read(rs2 + imm, 1);
+    break;
+  case OP_LOADBS:
+    rd = static_cast<int8_t>(read(rs2 + imm, 1));
+    break;
+  case OP_LOADH:
+    rd = read(rs2 + imm, 2);
+    break;
+  case OP_LOADHS:
+    rd = static_cast<int16_t>(read(rs2 + imm, 2));
+    break;
+  case OP_STOREB:
+    write(rs2 + imm, rd & 0xFF, 1);
+    break;
+  case OP_STOREH:
+    write(rs2 + imm, rd & 0xFFFF, 2);
+    break;
+  default:
+    return result::invalid;
+  }
+  state.pc += 4;
+  return result::next;
+ branch:
+  state.pc += (taken ? imm : 0) + 4;
+  return result::end_block;
+}
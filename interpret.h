@@ -0,0 +1,25 @@
+// -*- C++ -*-
+#ifndef INTERPRET_H_
+#define INTERPRET_H_
+#include "cpu.h"
+#include <cstdint>
+
+/* A plain switch interpreter over an explicit cpu_state, kept simple so that
+   it can serve as a second opinion on the threaded engine in execute.cc.
+   Memory is reached only through the virtual functions, which take the size
+   of the access in bytes. */
+class interpreter {
+public:
+  enum class result { next, end_block, invalid };
+
+  virtual ~interpreter() {}
+
+  result step(cpu_state&);
+
+private:
+  virtual std::uint32_t fetch(std::uint32_t) = 0;
+  virtual std::uint32_t read(std::uint32_t, unsigned) = 0;
+  virtual void write(std::uint32_t, std::uint32_t, unsigned) = 0;
+};
+
+#endif
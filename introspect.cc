@@ -0,0 +1,134 @@
+#include "introspect.h"
+#include "elf.h"
+#include "server.h"
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <string>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+using std::uint64_t;
+
+static int signal_pipe[2];
+
+static void report_handler(int) {
+  const int saved = errno;
+  const char c = 0;
+  [[maybe_unused]] const auto res = write(signal_pipe[1], &c, 1);
+  errno = saved;
+}
+
+static uint64_t resident_bytes() {
+  std::ifstream statm{"/proc/self/statm"};
+  uint64_t size = 0, resident = 0;
+  statm >> size >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+class introspector {
+  using clock = std::chrono::steady_clock;
+
+  const std::vector<CPU*> cpus;
+  const int control;
+  std::vector<uint64_t> last;
+  std::vector<double> mips;
+  clock::time_point sampled = clock::now();
+
+  void sample();
+  std::string report() const;
+  void run();
+
+public:
+  introspector(std::vector<CPU*> cpus, int control)
+    : cpus{std::move(cpus)}, control{control}, last(this->cpus.size()),
+      mips(this->cpus.size()) {
+    std::thread{&introspector::run, this}.detach();
+  }
+};
+
+void introspector::sample() {
+  const auto now = clock::now();
+  const double us =
+    std::chrono::duration<double, std::micro>(now - sampled).count();
+  for(std::size_t i = 0; i < cpus.size(); i++) {
+    const uint64_t retired = cpus[i]->get_retired();
+    // Going back in the debugger lowers the count.
+    mips[i] = retired >= last[i] && us > 0 ? (retired - last[i]) / us : 0;
+    last[i] = retired;
+  }
+  sampled = now;
+}
+
+std::string introspector::report() const {
+  std::ostringstream out;
+  for(std::size_t i = 0; i < cpus.size(); i++) {
+    const CPU& cpu = *cpus[i];
+    const std::uint32_t pc = cpu.get_current_block();
+    out << "cpu " << i << ": block 0x" << std::hex << pc << std::dec;
+    if(const auto sym = symbolize(pc); !sym.empty())
+      out << " <" << sym << '>';
+    out << ", " << cpu.get_retired() << " instructions, " << mips[i]
+	<< " MIPS, " << cpu.get_fast_accesses() << " fast and "
+	<< cpu.get_slow_accesses() << " slow accesses\n";
+  }
+  out << "rss " << resident_bytes() << " bytes\n";
+  return out.str();
+}
+
+void introspector::run() {
+  auto next = clock::now() + std::chrono::seconds{1};
+  while(true) {
+    pollfd fds[2] = { { signal_pipe[0], POLLIN, 0 }, { control, POLLIN, 0 } };
+    const auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>
+      (next - clock::now()).count();
+    const int res = poll(fds, control == -1 ? 1 : 2, timeout > 0 ? timeout : 0);
+    if(res == -1 && errno != EINTR) {
+      std::perror("cannot wait for introspection requests");
+      return;
+    }
+    if(clock::now() >= next) {
+      sample();
+      next += std::chrono::seconds{1};
+    }
+    if(res <= 0) continue;
+    if(fds[0].revents & POLLIN) {
+      char buf[64];
+      while(read(signal_pipe[0], buf, sizeof(buf)) > 0);
+      const std::string text = report();
+      [[maybe_unused]] const auto written =
+	write(2, text.data(), text.size());
+    }
+    if(control != -1 && fds[1].revents & POLLIN) {
+      const int conn = accept4(control, NULL, NULL, SOCK_CLOEXEC);
+      if(conn == -1) continue;
+      const std::string text = report();
+      [[maybe_unused]] const auto sent =
+	send(conn, text.data(), text.size(), MSG_NOSIGNAL);
+      close(conn);
+    }
+  }
+}
+
+void start_introspection(std::vector<CPU*> cpus, const char * path) {
+  for(CPU * cpu : cpus) cpu->count_accesses();
+  if(pipe2(signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    std::perror("cannot create signal pipe");
+    std::exit(-3);
+  }
+  struct sigaction sa;
+  sa.sa_handler = report_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sa, NULL);
+  new introspector(std::move(cpus), path ? listen_on(path) : -1);
+}
@@ -0,0 +1,14 @@
+// -*- C++ -*-
+#ifndef INTROSPECT_H_
+#define INTROSPECT_H_
+#include "cpu.h"
+#include <vector>
+
+/* Reports on the CPUs without stopping them: to stderr whenever the process
+   gets SIGUSR1, and to each client connecting to the Unix socket at the path,
+   if given.  The CPUs count their accesses from then on, and a host thread
+   samples the counters the engines publish every second to give the current
+   rate. */
+void start_introspection(std::vector<CPU*>, const char*);
+
+#endif
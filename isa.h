@@ -0,0 +1,62 @@
+// -*- C++ -*-
+#ifndef ISA_H_
+#define ISA_H_
+#include <cstdint>
+
+/* Whether the extension opcodes, those after OP_LOADI16H, run rather than
+   being invalid, as they are for images written for the base instruction
+   set. */
+extern bool extended_isa;
+
+/* The extension operations, shared by both engines.  Shifts take the amount
+   modulo 32.  None of them traps: dividing by zero gives all ones and leaves
+   the dividend as the remainder, and dividing the most negative number by -1
+   gives it back with a remainder of 0. */
+namespace isa {
+  constexpr std::uint32_t shl(std::uint32_t a, std::uint32_t b) {
+    return a << (b & 31);
+  }
+
+  constexpr std::uint32_t shr(std::uint32_t a, std::uint32_t b) {
+    return a >> (b & 31);
+  }
+
+  constexpr std::uint32_t sar(std::uint32_t a, std::uint32_t b) {
+    return static_cast<std::int32_t>(a) >> (b & 31);
+  }
+
+  constexpr std::uint32_t mul(std::uint32_t a, std::uint32_t b) {
+    return a * b;
+  }
+
+  constexpr std::uint32_t mulh(std::uint32_t a, std::uint32_t b) {
+    return std::int64_t{static_cast<std::int32_t>(a)}
+      * static_cast<std::int32_t>(b) >> 32;
+  }
+
+  constexpr std::uint32_t mulhu(std::uint32_t a, std::uint32_t b) {
+    return std::uint64_t{a} * b >> 32;
+  }
+
+  constexpr std::uint32_t div(std::uint32_t a, std::uint32_t b) {
+    if(b == 0) return 0xFFFFFFFF;
+    if(a == 0x80000000 && b == 0xFFFFFFFF) return a;
+    return static_cast<std::int32_t>(a) / static_cast<std::int32_t>(b);
+  }
+
+  constexpr std::uint32_t divu(std::uint32_t a, std::uint32_t b) {
+    return b == 0 ? 0xFFFFFFFF : a / b;
+  }
+
+  constexpr std::uint32_t rem(std::uint32_t a, std::uint32_t b) {
+    if(b == 0) return a;
+    if(a == 0x80000000 && b == 0xFFFFFFFF) return 0;
+    return static_cast<std::int32_t>(a) % static_cast<std::int32_t>(b);
+  }
+
+  constexpr std::uint32_t remu(std::uint32_t a, std::uint32_t b) {
+    return b == 0 ? a : a % b;
+  }
+}
+
+#endif
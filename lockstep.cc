@@ -0,0 +1,130 @@
+#include "lockstep.h"
+#include "device.h"
+#include "emulate.h"
+#include "elf.h"
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+
+using std::uint32_t;
+
+/* Whether an access is served only by array devices, so that reading it
+   twice has no side effects. */
+static bool plain_memory(uint32_t addr, unsigned size) {
+  return dynamic_cast<array_device*>(get_device(addr))
+    && dynamic_cast<array_device*>(get_device(addr + size - 1));
+}
+
+void lockstep::load(uint32_t addr, uint32_t value, unsigned size) {
+  if(!plain_memory(addr, size)) reads.push_back({addr, value});
+}
+
+void lockstep::store(uint32_t addr, uint32_t value, unsigned size) {
+  writes.push_back({addr, value});
+  if(plain_memory(addr, size))
+    for(uint32_t i = 0; i < size; i++)
+      overwritten.push_back({addr + i, ::get_byte(addr + i)});
+}
+
+uint32_t lockstep::get(uint32_t addr, unsigned size) {
+  uint32_t res = 0;
+  for(uint32_t i = 0; i < size; i++) {
+    const auto it = overlay.find(addr + i);
+    res |= uint32_t{it != overlay.end() ? it->second : ::get_byte(addr + i)}
+      << i*8;
+  }
+  return res;
+}
+
+uint32_t lockstep::fetch(uint32_t addr) {
+  return plain_memory(addr, 4) ? get(addr, 4) : ::get_word(addr);
+}
+
+uint32_t lockstep::read(uint32_t addr, unsigned size) {
+  if(plain_memory(addr, size)) return get(addr, size);
+  if(replayed == reads.size() || reads[replayed].first != addr) {
+    problem = "device reads differ";
+    return 0;
+  }
+  return reads[replayed++].second;
+}
+
+void lockstep::write(uint32_t addr, uint32_t value, unsigned size) {
+  replay_writes.push_back({addr, value});
+  if(plain_memory(addr, size))
+    for(uint32_t i = 0; i < size; i++) overlay[addr + i] = value >> i*8 & 0xFF;
+}
+
+static void print_addr(uint32_t addr) {
+  std::cerr << "0x" << std::hex << addr << std::dec;
+  if(const auto sym = symbolize(addr); !sym.empty())
+    std::cerr << " <" << sym << '>';
+}
+
+static void print_states(const char * name, const cpu_state& state) {
+  std::cerr << name << ": pc=";
+  print_addr(state.pc);
+  std::cerr << std::hex;
+  for(int i = 0; i < 8; i++)
+    std::cerr << " r" << i << "=0x" << state.regs[i];
+  std::cerr << std::dec << " Z=" << state.Z << " N=" << state.N
+	    << " cmp=" << state.cmp << '\n';
+}
+
+static void print_writes(const char * name,
+			 const std::vector<std::pair<uint32_t, uint32_t>>& w) {
+  std::cerr << name << " stores:" << std::hex;
+  for(const auto& [addr, value] : w)
+    std::cerr << " [0x" << addr << "]=0x" << value;
+  std::cerr << std::dec << '\n';
+}
+
+void lockstep::diverged(const cpu_state& expected, const cpu_state& actual) {
+  std::cerr << "lockstep: " << problem << " after the block at ";
+  print_addr(start.pc);
+  std::cerr << '\n';
+  for(uint32_t pc = start.pc, n = 0; n < 64; pc += 4, n++) {
+    const uint32_t inst = fetch(pc);
+    std::cerr << "  0x" << std::hex << pc << std::dec << ": ";
+    std::cerr.flush();
+    print_inst(inst, stderr);
+    std::fflush(stderr);
+    const enum opcode op = inst_opcode(inst);
+    if(op == OP_JUMP || op == OP_BRANCH || op == OP_CALL
+       || (op >= OP_BEQ && op <= OP_BGT) || op > OPCODES)
+      break;
+  }
+  print_states("threaded", actual);
+  print_states("interpreter", expected);
+  print_writes("threaded", writes);
+  print_writes("interpreter", replay_writes);
+  std::exit(-4);
+}
+
+unsigned lockstep::block(const cpu_state& state) {
+  if(started) {
+    overlay.clear();
+    for(auto it = overwritten.crbegin(); it != overwritten.crend(); ++it)
+      overlay[it->first] = it->second;
+    replayed = 0;
+    replay_writes.clear();
+    problem = nullptr;
+    cpu_state expected = start;
+    for(unsigned long n = 0; !problem; n++) {
+      const result res = step(expected);
+      if(res == result::end_block) break;
+      if(res == result::invalid) problem = "invalid instruction";
+      else if(n >= 1ul << 24) problem = "block does not end";
+    }
+    if(!problem && expected != state) problem = "states differ";
+    if(!problem && replay_writes != writes) problem = "stores differ";
+    if(!problem && replayed != reads.size()) problem = "device reads differ";
+    if(problem) diverged(expected, state);
+  }
+  start = state;
+  started = true;
+  reads.clear();
+  writes.clear();
+  overwritten.clear();
+  return accesses;
+}
@@ -0,0 +1,42 @@
+// -*- C++ -*-
+#ifndef LOCKSTEP_H_
+#define LOCKSTEP_H_
+#include "cpu.h"
+#include "interpret.h"
+#include <vector>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+
+/* Checks the threaded engine against the interpreter one block at a time.
+   The threaded engine runs each block for real, logging its reads of devices
+   other than array devices and the previous contents of the memory it
+   overwrites.  The interpreter then reruns the block from the saved state on
+   a view of memory as it was before the block, replaying the logged device
+   reads, and the resulting state and stores must match. */
+class lockstep final : public observer, interpreter {
+  using access = std::pair<std::uint32_t, std::uint32_t>;
+
+  cpu_state start{};
+  bool started = false;
+  std::vector<access> reads;
+  std::vector<access> writes;
+  std::vector<std::pair<std::uint32_t, std::uint8_t>> overwritten;
+  std::size_t replayed;
+  std::vector<access> replay_writes;
+  std::unordered_map<std::uint32_t, std::uint8_t> overlay;
+  const char * problem;
+
+  std::uint32_t get(std::uint32_t, unsigned);
+  [[noreturn]] void diverged(const cpu_state&, const cpu_state&);
+
+  unsigned block(const cpu_state&) override;
+  void load(std::uint32_t, std::uint32_t, unsigned) override;
+  void store(std::uint32_t, std::uint32_t, unsigned) override;
+
+  std::uint32_t fetch(std::uint32_t) override;
+  std::uint32_t read(std::uint32_t, unsigned) override;
+  void write(std::uint32_t, std::uint32_t, unsigned) override;
+};
+
+#endif
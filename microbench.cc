@@ -0,0 +1,146 @@
+#include "device.h"
+#include <unistd.h>
+#include <iostream>
+#include <chrono>
+#include <array>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+
+using std::uint32_t;
+
+/* The layout puts each kind of devtab entry behind its own addresses: a
+   memory filling a whole top-level entry, one split into 4 KiB entries, a
+   small device split down to words, and a memory adjacent to the first so
+   that a word can straddle the two. */
+static constexpr uint32_t whole = 0x400000;
+static constexpr uint32_t paged = 0x1000;
+static constexpr uint32_t small = 0x2000;
+static constexpr uint32_t adjacent = 0x800000;
+
+static unsigned long iterations = 1 << 24;
+static int repeats = 5;
+static uint32_t sink;
+
+/* Keeps the compiler from dropping the value or hoisting the access out of
+   the loop. */
+template<typename T> [[gnu::always_inline]] static inline void keep(T value) {
+#ifdef __GNUC__
+  asm volatile("" : : "r"(value) : "memory");
+#else
+  sink ^= static_cast<uint32_t>(value);
+#endif
+}
+
+/* Runs the operation over 64 addresses starting at the given one and spaced
+   by the stride, and reports the best time per operation over the
+   repeats. */
+template<typename F>
+static void bench(const char * name, uint32_t start, uint32_t stride, F op) {
+  std::array<uint32_t, 64> addrs;
+  for(std::size_t i = 0; i < addrs.size(); i++)
+    addrs[i] = start + static_cast<uint32_t>(i)*stride;
+  double best = 0;
+  for(int r = 0; r < repeats; r++) {
+    const auto begin = std::chrono::steady_clock::now();
+    for(unsigned long i = 0; i < iterations; i++)
+      op(addrs[i & 63]);
+    const std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - begin;
+    const double ns = elapsed.count() / iterations;
+    if(r == 0 || ns < best) best = ns;
+  }
+  std::printf("%s\t%.3f\n", name, best);
+}
+
+int main(int argc, char * const * argv) {
+  int c;
+  while((c = getopt(argc, argv, "n:r:")) != -1) {
+    switch(c) {
+    case 'n':
+      iterations = std::strtoul(optarg, NULL, 0);
+      break;
+    case 'r':
+      repeats = std::atoi(optarg);
+      break;
+    default:
+      return -1;
+    }
+  }
+  if(iterations == 0 || repeats < 1) {
+    std::cerr << "iterations and repeats must be positive\n";
+    return -1;
+  }
+
+  new zero_device{0, 0xFFFFFFFF};
+  memory * const mem = new memory(whole, 0x3FFFFF);
+  new memory(paged, 0xFFF);
+  device * const zero = new zero_device{small, 7};
+  new memory(adjacent, 0x3FFFFF);
+  uint32_t * const contents = mem->get_contents();
+  const uint32_t limit = mem->get_limit();
+
+  std::printf("# benchmark\tns/op\n");
+  bench("get_device/top-level", whole, 0x10000, [](uint32_t addr) {
+    keep(get_device(addr));
+  });
+  bench("get_device/4k", paged, 64, [](uint32_t addr) {
+    keep(get_device(addr));
+  });
+  bench("get_device/word", small, 0, [](uint32_t addr) {
+    keep(get_device(addr));
+  });
+  bench("get_word/aligned", whole, 0x10000, [](uint32_t addr) {
+    keep(get_word(addr));
+  });
+  bench("get_word/unaligned", whole + 1, 0x10000, [](uint32_t addr) {
+    keep(get_word(addr));
+  });
+  bench("get_word/cross-device", adjacent - 2, 0, [](uint32_t addr) {
+    keep(get_word(addr));
+  });
+  bench("set_word/aligned", whole, 0x10000, [](uint32_t addr) {
+    set_word(addr, addr);
+  });
+  bench("set_word/unaligned", whole + 1, 0x10000, [](uint32_t addr) {
+    set_word(addr, addr);
+  });
+  bench("set_word/cross-device", adjacent - 2, 0, [](uint32_t addr) {
+    set_word(addr, addr);
+  });
+  /* device::get_word masks the word with clean_word, which has a path for
+     offsets well inside the device, one for the last three bytes and one for
+     offsets wrapping below the base. */
+  bench("clean_word/inside", 0, 4, [&](uint32_t off) {
+    keep(mem->get_word(off));
+  });
+  bench("clean_word/end", limit - 2, 0, [&](uint32_t off) {
+    keep(mem->get_word(off));
+  });
+  bench("clean_word/wrapped", -2, 0, [&](uint32_t off) {
+    keep(mem->get_word(off));
+  });
+  bench("get_word_raw/aligned", 0, 0x10000, [&](uint32_t off) {
+    keep(get_word_raw(contents, limit, off));
+  });
+  bench("get_word_raw/unaligned", 1, 0x10000, [&](uint32_t off) {
+    keep(get_word_raw(contents, limit, off));
+  });
+  bench("set_word_raw/aligned", 0, 0x10000, [&](uint32_t off) {
+    set_word_raw(contents, limit, off, off);
+  });
+  bench("set_word_raw/unaligned", 1, 0x10000, [&](uint32_t off) {
+    set_word_raw(contents, limit, off, off);
+  });
+  /* An array device overrides get_word_impl; other devices inherit the
+     bytewise version, which makes four more virtual calls. */
+  bench("get_word_impl/array_device", 0, 0x10000, [&](uint32_t off) {
+    device * const dev = mem;
+    keep(dev->get_word(off));
+  });
+  bench("get_word_impl/bytewise", 0, 0, [&](uint32_t off) {
+    keep(zero->get_word(off));
+  });
+  return sink == 1;
+}
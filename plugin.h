@@ -0,0 +1,76 @@
+/* Interface for instrumentation plugins, which are shared objects loaded with
+   --plugin FILE[,ARG...].  A plugin exports srisc_plugin_install, which is
+   called once with its arguments and registers callbacks through the
+   functions below; these are resolved against the emulator itself.  The
+   emulator only instruments blocks, instructions and accesses that some
+   plugin registered a callback for, and runs at full speed without plugins.
+
+   The first time a CPU enters a block, the translation callbacks are called
+   with a description of the block that is valid for the duration of the
+   call, and may register callbacks on it and on its instructions.  A block
+   runs from its first instruction to the next control transfer.  Blocks are
+   translated separately on each CPU, and the callbacks for a CPU run on its
+   thread. */
+#ifndef PLUGIN_H_
+#define PLUGIN_H_
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SRISC_PLUGIN_VERSION 1
+
+typedef struct srisc_plugin srisc_plugin;
+typedef struct srisc_block srisc_block;
+
+enum srisc_device_kind {
+  SRISC_DEVICE_MEMORY,		/* writable RAM */
+  SRISC_DEVICE_ROM,		/* other memory-like devices */
+  SRISC_DEVICE_MMIO		/* everything else */
+};
+
+struct srisc_access {
+  uint32_t addr;
+  uint32_t value;
+  unsigned size;
+  int store;
+  uint32_t device_base;
+  enum srisc_device_kind device;
+};
+
+typedef void (*srisc_translate_cb)(unsigned cpu, srisc_block * block,
+				   void * data);
+typedef void (*srisc_block_cb)(unsigned cpu, uint32_t pc, void * data);
+typedef void (*srisc_insn_cb)(unsigned cpu, uint32_t pc, uint32_t inst,
+			      void * data);
+typedef void (*srisc_access_cb)(unsigned cpu, uint32_t pc,
+				const struct srisc_access * access,
+				void * data);
+typedef void (*srisc_exit_cb)(void * data);
+
+/* Called by the emulator with the interface version it implements; returns
+   0 on success. */
+int srisc_plugin_install(srisc_plugin * plugin, int version, int argc,
+			 char ** argv);
+
+void srisc_register_translate_cb(srisc_plugin * plugin, srisc_translate_cb cb,
+				 void * data);
+void srisc_register_exit_cb(srisc_plugin * plugin, srisc_exit_cb cb,
+			    void * data);
+
+uint32_t srisc_block_pc(const srisc_block * block);
+size_t srisc_block_insns(const srisc_block * block);
+uint32_t srisc_block_insn(const srisc_block * block, size_t index);
+
+void srisc_block_register_exec_cb(srisc_block * block, srisc_block_cb cb,
+				  void * data);
+void srisc_insn_register_exec_cb(srisc_block * block, size_t index,
+				 srisc_insn_cb cb, void * data);
+void srisc_insn_register_access_cb(srisc_block * block, size_t index,
+				   srisc_access_cb cb, void * data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,210 @@
+#include "plugin_host.h"
+#include "plugin.h"
+#include "device.h"
+#include "inst.h"
+#include "isa.h"
+#include <dlfcn.h>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <unordered_map>
+#include <cstring>
+#include <cstdlib>
+
+using std::uint32_t;
+
+template<typename F> using callbacks = std::vector<std::pair<F, void*>>;
+
+struct srisc_plugin {
+  std::vector<std::string> args;
+  callbacks<srisc_translate_cb> translate;
+  callbacks<srisc_exit_cb> exit;
+};
+
+struct srisc_block {
+  uint32_t pc;
+  std::vector<uint32_t> insns;
+  callbacks<srisc_block_cb> exec;
+  std::vector<callbacks<srisc_insn_cb>> insn_exec;
+  std::vector<callbacks<srisc_access_cb>> insn_access;
+};
+
+static std::vector<std::unique_ptr<srisc_plugin>> plugins;
+
+/* The translated blocks of one CPU, with the events each asks for. */
+class plugin_cpu final : public observer {
+  static constexpr std::size_t max_insns = 1 << 16;
+
+  struct translation {
+    srisc_block block;
+    unsigned events;
+  };
+
+  const unsigned id;
+  std::unordered_map<uint32_t, translation> blocks;
+  translation * current = nullptr;
+  uint32_t pc = 0;
+
+  translation& translate(uint32_t);
+  void access(uint32_t, uint32_t, unsigned, bool);
+
+  unsigned block(const cpu_state&) override;
+  void instruction(uint32_t, uint32_t) override;
+  void load(uint32_t, uint32_t, unsigned) override;
+  void store(uint32_t, uint32_t, unsigned) override;
+
+public:
+  explicit plugin_cpu(unsigned id) : id{id} {}
+};
+
+plugin_cpu::translation& plugin_cpu::translate(uint32_t start) {
+  translation& t = blocks[start];
+  srisc_block& b = t.block;
+  b.pc = start;
+  /* Decoding stops short of words outside array devices: the block may run
+     into them, but reading them here could consume device input. */
+  for(uint32_t addr = start; b.insns.size() < max_insns; addr += 4) {
+    const std::optional<uint32_t> inst = peek_word(addr);
+    if(!inst) break;
+    b.insns.push_back(*inst);
+    if(ends_block(*inst, extended_isa)) break;
+  }
+  b.insn_exec.resize(b.insns.size());
+  b.insn_access.resize(b.insns.size());
+  for(const auto& plugin : plugins)
+    for(const auto& [cb, data] : plugin->translate) cb(id, &b, data);
+  t.events = 0;
+  for(std::size_t i = 0; i < b.insns.size(); i++) {
+    if(!b.insn_exec[i].empty()) t.events |= instructions;
+    if(!b.insn_access[i].empty()) t.events |= instructions | accesses;
+  }
+  return t;
+}
+
+unsigned plugin_cpu::block(const cpu_state& state) {
+  const auto it = blocks.find(state.pc);
+  current = it != blocks.end() ? &it->second : &translate(state.pc);
+  pc = state.pc;
+  for(const auto& [cb, data] : current->block.exec) cb(id, state.pc, data);
+  return current->events;
+}
+
+void plugin_cpu::instruction(uint32_t pc, uint32_t inst) {
+  this->pc = pc;
+  const std::size_t index = (pc - current->block.pc) / 4;
+  if(index >= current->block.insns.size()) return;
+  for(const auto& [cb, data] : current->block.insn_exec[index])
+    cb(id, pc, inst, data);
+}
+
+void plugin_cpu::access(uint32_t addr, uint32_t value, unsigned size,
+			bool store) {
+  const std::size_t index = (pc - current->block.pc) / 4;
+  if(index >= current->block.insns.size()
+     || current->block.insn_access[index].empty())
+    return;
+  device * const dev = get_device(addr);
+  const srisc_access access{
+    .addr = addr, .value = value, .size = size, .store = store,
+    .device_base = dev->get_base(),
+    .device = dynamic_cast<memory*>(dev) ? SRISC_DEVICE_MEMORY
+    : dynamic_cast<array_device*>(dev) ? SRISC_DEVICE_ROM
+    : SRISC_DEVICE_MMIO
+  };
+  for(const auto& [cb, data] : current->block.insn_access[index])
+    cb(id, pc, &access, data);
+}
+
+void plugin_cpu::load(uint32_t addr, uint32_t value, unsigned size) {
+  access(addr, value, size, false);
+}
+
+void plugin_cpu::store(uint32_t addr, uint32_t value, unsigned size) {
+  access(addr, value, size, true);
+}
+
+static void finish_plugins() {
+  for(const auto& plugin : plugins)
+    for(const auto& [cb, data] : plugin->exit) cb(data);
+}
+
+void load_plugin(const char * spec) {
+  auto plugin = std::make_unique<srisc_plugin>();
+  for(const char * cur = spec;;) {
+    const char * const comma = std::strchr(cur, ',');
+    plugin->args.emplace_back(cur, comma ? comma - cur : std::strlen(cur));
+    if(!comma) break;
+    cur = comma + 1;
+  }
+  const char * const name = plugin->args[0].c_str();
+  void * const handle = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+  if(!handle) {
+    std::cerr << "cannot load plugin: " << dlerror() << '\n';
+    std::exit(-3);
+  }
+  const auto install = reinterpret_cast<decltype(&srisc_plugin_install)>
+    (dlsym(handle, "srisc_plugin_install"));
+  if(!install) {
+    std::cerr << name << " is not a plugin\n";
+    std::exit(-3);
+  }
+  std::vector<char*> argv;
+  for(auto& arg : plugin->args) argv.push_back(arg.data());
+  argv.push_back(nullptr);
+  if(plugins.empty()) std::atexit(finish_plugins);
+  srisc_plugin * const p = plugin.get();
+  plugins.push_back(std::move(plugin));
+  if(install(p, SRISC_PLUGIN_VERSION, argv.size() - 1, argv.data()) != 0) {
+    std::cerr << "plugin " << name << " failed to install\n";
+    std::exit(-3);
+  }
+}
+
+static std::vector<std::unique_ptr<plugin_cpu>> plugin_cpus;
+
+void attach_plugins(CPU& cpu, unsigned id) {
+  if(plugins.empty()) return;
+  plugin_cpus.push_back(std::make_unique<plugin_cpu>(id));
+  cpu.observe_blocks(*plugin_cpus.back());
+}
+
+void srisc_register_translate_cb(srisc_plugin * plugin, srisc_translate_cb cb,
+				 void * data) {
+  plugin->translate.push_back({cb, data});
+}
+
+void srisc_register_exit_cb(srisc_plugin * plugin, srisc_exit_cb cb,
+			    void * data) {
+  plugin->exit.push_back({cb, data});
+}
+
+uint32_t srisc_block_pc(const srisc_block * block) {
+  return block->pc;
+}
+
+size_t srisc_block_insns(const srisc_block * block) {
+  return block->insns.size();
+}
+
+uint32_t srisc_block_insn(const srisc_block * block, size_t index) {
+  return index < block->insns.size() ? block->insns[index] : 0;
+}
+
+void srisc_block_register_exec_cb(srisc_block * block, srisc_block_cb cb,
+				  void * data) {
+  block->exec.push_back({cb, data});
+}
+
+void srisc_insn_register_exec_cb(srisc_block * block, size_t index,
+				 srisc_insn_cb cb, void * data) {
+  if(index < block->insns.size()) block->insn_exec[index].push_back({cb, data});
+}
+
+void srisc_insn_register_access_cb(srisc_block * block, size_t index,
+				   srisc_access_cb cb, void * data) {
+  if(index < block->insns.size())
+    block->insn_access[index].push_back({cb, data});
+}
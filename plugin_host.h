@@ -0,0 +1,14 @@
+// -*- C++ -*-
+#ifndef PLUGIN_HOST_H_
+#define PLUGIN_HOST_H_
+#include "cpu.h"
+
+/* Loads a plugin given as FILE[,ARG...] and installs it, exiting on
+   failure. */
+void load_plugin(const char*);
+
+/* Instruments the CPU with the given index for the loaded plugins, if
+   any. */
+void attach_plugins(CPU&, unsigned);
+
+#endif
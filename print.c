@@ -1,15 +1,16 @@
-#include "emulate.h"
+#include "inst.h"
 #include <stdio.h>
 #include <stdbool.h>
 
 static const char * const ops[] = {
   "add", "sub", "and", "or", "xor", "not", "load", "store", "jump", "branch",
   "cmp", "invalid", "beq", "bne", "blt", "bgt", "loadi", "call", "loadi16",
-  "loadi16h"
+  "loadi16h", "shl", "shr", "sar", "mul", "mulh", "mulhu", "div", "divu",
+  "rem", "remu", "loadb", "loadbs", "loadh", "loadhs", "storeb", "storeh"
 };
 
-static inline const char * op_name(enum opcode opcode) {
-  if(opcode > sizeof(ops)/sizeof(char*))
+const char * op_name(enum opcode opcode) {
+  if(opcode >= sizeof(ops)/sizeof(char*))
     return "invalid";
   return ops[opcode];
 }
@@ -27,6 +28,16 @@ void print_inst(uint32_t inst, FILE * fp) {
   case OP_AND:
   case OP_OR:
   case OP_XOR:
+  case OP_SHL:
+  case OP_SHR:
+  case OP_SAR:
+  case OP_MUL:
+  case OP_MULH:
+  case OP_MULHU:
+  case OP_DIV:
+  case OP_DIVU:
+  case OP_REM:
+  case OP_REMU:
     fprintf(fp, "%s r%d, r%d, r%d\n", op, rd, rs1, rs2);
     break;
   case OP_NOT:
@@ -34,6 +45,12 @@ void print_inst(uint32_t inst, FILE * fp) {
     break;
   case OP_LOAD:
   case OP_STORE:
+  case OP_LOADB:
+  case OP_LOADBS:
+  case OP_LOADH:
+  case OP_LOADHS:
+  case OP_STOREB:
+  case OP_STOREH:
     fprintf(fp, "%s r%d, r%d, %ld\n", op, rd, rs2, imm);
     break;
   case OP_JUMP:
@@ -56,7 +73,7 @@ void print_inst(uint32_t inst, FILE * fp) {
     break;
   case OP_CALL:
     if(rs1 != 0 || rs2 != 0 || imm != 0)
-      puts("invalid");
+      fputs("invalid\n", fp);
     else fprintf(fp, "call r%d\n", rd);
     break;
   case OP_LOADI16:
@@ -0,0 +1,139 @@
+#define _POSIX_C_SOURCE 200809L
+#include "profile.h"
+#include "device.h"
+#include "emulate.h"
+#include "elf.h"
+#include <signal.h>
+#include <sys/time.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <cstdlib>
+
+using std::uint32_t;
+using std::uint64_t;
+
+sampler * sampler::active = nullptr;
+
+void sampler::handler(int) {
+  sampler * const self = active;
+  if(!self) return;
+  const uint64_t slot = self->head.fetch_add(1, std::memory_order_relaxed);
+  self->ring[slot % ring_size].store(uint64_t{1} << 32
+				     | self->cpu.get_current_block(),
+				     std::memory_order_release);
+}
+
+void sampler::drain() {
+  const uint64_t head = this->head.load(std::memory_order_relaxed);
+  for(; tail != head; tail++) {
+    const uint64_t sample =
+      ring[tail % ring_size].exchange(0, std::memory_order_acquire);
+    if(!sample) break;
+    histogram[sample & 0xFFFFFFFF]++;
+    total++;
+  }
+}
+
+sampler::sampler(const CPU& cpu, unsigned hz) : cpu{cpu} {
+  active = this;
+  struct sigaction sa;
+  sa.sa_handler = handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, NULL);
+  drainer = std::thread{[this]() {
+    while(!stopping.load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds{10});
+      drain();
+    }
+  }};
+  const long usec = 1000000 / (hz ? hz : 1);
+  struct itimerval timer;
+  timer.it_interval.tv_sec = usec / 1000000;
+  timer.it_interval.tv_usec = usec % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+void sampler::stop() {
+  const struct itimerval timer{};
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+  stopping = true;
+  if(drainer.joinable()) drainer.join();
+  drain();
+  active = nullptr;
+}
+
+void sampler::write_histogram(std::FILE * fp) {
+  std::vector<std::pair<uint32_t, uint64_t>> blocks(histogram.begin(),
+						    histogram.end());
+  std::sort(blocks.begin(), blocks.end(), [](const auto& a, const auto& b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  });
+  std::fprintf(fp, "%llu samples\n", static_cast<unsigned long long>(total));
+  for(const auto& [addr, count] : blocks) {
+    std::fprintf(fp, "%10llu %6.2f%% 0x%08lx",
+		 static_cast<unsigned long long>(count), 100.0 * count / total,
+		 static_cast<unsigned long>(addr));
+    if(const auto sym = symbolize(addr); !sym.empty())
+      std::fprintf(fp, " <%s>", sym.c_str());
+    std::fputs(": ", fp);
+    print_inst(get_word(addr), fp);
+  }
+}
+
+void sampler::write_folded(std::FILE * fp) {
+  for(const auto& [addr, count] : histogram) {
+    if(const symbol * const sym = find_symbol(addr))
+      std::fprintf(fp, "%s;", sym->name.c_str());
+    std::fprintf(fp, "0x%08lx %llu\n", static_cast<unsigned long>(addr),
+		 static_cast<unsigned long long>(count));
+  }
+}
+
+static CPU * profiled_cpu;
+static std::unique_ptr<sampler> profiler;
+static const char * histogram_name;
+static const char * folded_name;
+
+static void interrupt_handler(int) {
+  profiled_cpu->interrupt();
+}
+
+static void write_profile(const char * name, void (sampler::*write)(FILE*)) {
+  if(!name) return;
+  std::FILE * const fp = std::fopen(name, "w");
+  if(!fp) {
+    std::perror(name);
+    return;
+  }
+  (profiler.get()->*write)(fp);
+  std::fclose(fp);
+}
+
+static void finish_profile() {
+  if(!profiler) return;
+  profiler->stop();
+  write_profile(histogram_name, &sampler::write_histogram);
+  write_profile(folded_name, &sampler::write_folded);
+  profiler.reset();
+}
+
+/* Profiles the CPU until the program exits.  The first SIGINT stops the CPU so
+   that the profile can still be written. */
+void start_profile(CPU& cpu, unsigned hz, const char * histogram,
+		   const char * folded) {
+  profiled_cpu = &cpu;
+  histogram_name = histogram;
+  folded_name = folded;
+  struct sigaction sa;
+  sa.sa_handler = interrupt_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESETHAND;
+  sigaction(SIGINT, &sa, NULL);
+  profiler = std::make_unique<sampler>(cpu, hz);
+  std::atexit(finish_profile);
+}
@@ -0,0 +1,43 @@
+// -*- C++ -*-
+#ifndef PROFILE_H_
+#define PROFILE_H_
+#include "cpu.h"
+#include <array>
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <cstdio>
+#include <cstdint>
+
+/* Samples the block the CPU is executing from a SIGPROF interval timer.  The
+   signal handler only copies the block address the engine publishes into a
+   ring, which a separate thread drains into a histogram. */
+class sampler {
+  static constexpr std::size_t ring_size = 1 << 16;
+
+  const CPU& cpu;
+  std::array<std::atomic<std::uint64_t>, ring_size> ring{};
+  std::atomic<std::uint64_t> head{0};
+  std::uint64_t tail = 0;
+  std::unordered_map<std::uint32_t, std::uint64_t> histogram;
+  std::uint64_t total = 0;
+  std::atomic_bool stopping{false};
+  std::thread drainer;
+
+  static sampler * active;
+  static void handler(int);
+  void drain();
+
+public:
+  sampler(const CPU&, unsigned);
+  sampler(const sampler&) = delete;
+  sampler& operator=(const sampler&) = delete;
+
+  void stop();
+  void write_histogram(std::FILE*);
+  void write_folded(std::FILE*);
+};
+
+void start_profile(CPU&, unsigned, const char*, const char*);
+
+#endif
@@ -0,0 +1,86 @@
+#include "record.h"
+#include "device.h"
+#include <iostream>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+
+recorder::recorder(CPU& cpu, input_log& log, std::uint64_t interval,
+		   std::size_t limit)
+  : cpu{cpu}, log{log}, interval{std::max<std::uint64_t>(interval, 1)},
+    limit{std::max<std::size_t>(limit, 2)}, devices{checkpointed_devices()} {
+  log.count(cpu.retired);
+}
+
+unsigned recorder::block(const cpu_state& state) {
+  // Re-executing repeats the same run, so later checkpoints stay valid.
+  if(!checkpoints.empty()
+     && cpu.retired < checkpoints.back().retired + interval)
+    return 0;
+  checkpoint cp{cpu.retired, state, log.get_position(), {}};
+  for(array_device * dev : devices) {
+    const char * const contents =
+      reinterpret_cast<const char*>(dev->get_contents());
+    cp.contents.emplace_back(contents,
+			     contents + std::size_t{dev->get_limit()} + 1);
+  }
+  if(checkpoints.size() >= limit)
+    for(std::size_t i = 1; i < checkpoints.size(); i++)
+      checkpoints.erase(checkpoints.begin() + i);
+  checkpoints.push_back(std::move(cp));
+  return 0;
+}
+
+std::size_t recorder::latest(std::uint64_t retired) const {
+  const auto it = std::upper_bound(checkpoints.begin(), checkpoints.end(),
+				   retired, [](std::uint64_t r, const auto& cp) {
+				     return r < cp.retired;
+				   });
+  return it - checkpoints.begin() - 1;
+}
+
+void recorder::restore(std::size_t i, std::uint64_t stop_at) {
+  const checkpoint& cp = checkpoints[i];
+  for(std::size_t d = 0; d < devices.size(); d++)
+    std::memcpy(devices[d]->get_contents(), cp.contents[d].data(),
+		cp.contents[d].size());
+  log.set_position(cp.position);
+  cpu.resume = cp.state;
+  cpu.retired = cp.retired;
+  cpu.stop_at = stop_at;
+}
+
+bool recorder::reverse_step() {
+  log.advance();
+  const std::uint64_t target = cpu.retired - 1;
+  restore(latest(target), target);
+  return true;
+}
+
+bool recorder::reverse_continue() {
+  log.advance();
+  const std::uint64_t end = cpu.retired;
+  scanning = true;
+  hits.clear();
+  scanned = latest(end - 1);
+  restore(scanned, end);
+  return true;
+}
+
+bool recorder::reached() {
+  if(!scanning) return false;
+  if(!hits.empty()) {
+    scanning = false;
+    restore(scanned, hits.back());
+  }
+  else if(scanned == 0) {
+    scanning = false;
+    std::cerr << "no earlier breakpoint hit\n";
+    restore(0, checkpoints[0].retired);
+  }
+  else {
+    scanned--;
+    restore(scanned, checkpoints[scanned + 1].retired);
+  }
+  return true;
+}
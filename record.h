@@ -0,0 +1,56 @@
+// -*- C++ -*-
+#ifndef RECORD_H_
+#define RECORD_H_
+#include "cpu.h"
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+class array_device;
+class input_log;
+
+/* Checkpoints a CPU, the devices it writes as memory and the position in the
+   input log every so many instructions, at the end of a block.  Going back
+   restores the latest checkpoint before the instruction wanted and
+   re-executes up to it with the logged inputs.  Once there are as many
+   checkpoints as allowed, every other one is dropped, keeping the first.
+   Observing the CPU, it keeps it in the instrumented engine throughout. */
+class recorder final : public observer {
+  struct checkpoint {
+    std::uint64_t retired;
+    cpu_state state;
+    std::size_t position;
+    std::vector<std::vector<char>> contents;
+  };
+
+  CPU& cpu;
+  input_log& log;
+  const std::uint64_t interval;
+  const std::size_t limit;
+  const std::vector<array_device*> devices;
+  std::vector<checkpoint> checkpoints;
+
+  /* reverse-continue re-executes from successively earlier checkpoints up to
+     where the previous attempt started, noting the breakpoint hits. */
+  bool scanning = false;
+  std::size_t scanned = 0;
+  std::vector<std::uint64_t> hits;
+
+  unsigned block(const cpu_state&) override;
+  std::size_t latest(std::uint64_t) const;
+  void restore(std::size_t, std::uint64_t);
+
+public:
+  recorder(CPU&, input_log&, std::uint64_t, std::size_t);
+
+  /* These return true if the CPU has to restart from the state restored. */
+  bool reverse_step();
+  bool reverse_continue();
+  bool reached();
+
+  void breakpoint_hit() {
+    if(scanning) hits.push_back(cpu.retired);
+  }
+};
+
+#endif
@@ -0,0 +1,175 @@
+#include "sampling.h"
+#include "analysis.h"
+#include "device.h"
+#include <sys/wait.h>
+#include <unistd.h>
+#include <signal.h>
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <cerrno>
+#include <cstdlib>
+
+using std::uint32_t;
+using std::uint64_t;
+
+interval_sampler::interval_sampler(CPU& cpu, scheduler& sched,
+				   input_log& log, analysis& analyser,
+				   uint64_t interval, std::size_t jobs)
+  : cpu{cpu}, sched{sched}, log{log}, analyser{analyser},
+    interval{std::max<uint64_t>(interval, 1)},
+    jobs{std::max<std::size_t>(jobs, 1)} {}
+
+void interval_sampler::start() {
+  if(fork_worker()) cpu.observe(*this);
+  else sample();
+}
+
+/* A worker leaves the loop and has the engine restart observed from the
+   end of the block it was forked at. */
+task interval_sampler::sample() {
+  while(true) {
+    co_await sched.delay(interval);
+    if(pending) hand_over(cpu.retired);
+    while(running.size() >= jobs) collect();
+    if(fork_worker()) {
+      cpu.observe(*this);
+      cpu.restart();
+      co_return;
+    }
+  }
+}
+
+/* Only workers observe the CPU. */
+unsigned interval_sampler::block(const cpu_state& state) {
+  if(cpu.retired >= end) finish_worker();
+  return static_cast<observer&>(analyser).block(state);
+}
+
+void interval_sampler::instruction(uint32_t pc, uint32_t inst) {
+  if(cpu.retired >= end) finish_worker();
+  static_cast<observer&>(analyser).instruction(pc, inst);
+}
+
+void interval_sampler::load(uint32_t addr, uint32_t value,
+			    unsigned size) {
+  static_cast<observer&>(analyser).load(addr, value, size);
+}
+
+void interval_sampler::store(uint32_t addr, uint32_t value,
+			     unsigned size) {
+  static_cast<observer&>(analyser).store(addr, value, size);
+}
+
+/* Returns true in the child, once its interval is known, without the
+   counts the parent has added so far.  The child counts instructions for the
+   log, which the parent's engine only does a block at a time.  Anything
+   buffered is written out first so that it is not written twice. */
+bool interval_sampler::fork_worker() {
+  int fds[2];
+  std::FILE * const file = std::tmpfile();
+  if(!file || pipe(fds) == -1) {
+    std::perror("cannot start an analysis worker");
+    std::exit(-3);
+  }
+  std::fflush(NULL);
+  const pid_t pid = fork();
+  if(pid == -1) {
+    std::perror("cannot start an analysis worker");
+    std::exit(-3);
+  }
+  if(pid == 0) {
+    signal(SIGINT, SIG_IGN);
+    close(fds[1]);
+    in_worker = true;
+    results = file;
+    analyser.clear();
+    log.count(cpu.retired);
+    receive(fds[0]);
+    return true;
+  }
+  close(fds[0]);
+  pending = worker{pid, file};
+  pending_fd = fds[1];
+  pending_position = log.get_position();
+  return false;
+}
+
+/* The parent going away first leaves nothing to do. */
+void interval_sampler::receive(int fd) {
+  std::FILE * const in = fdopen(fd, "rb");
+  if(!in || std::fread(&end, sizeof(end), 1, in) != 1) _exit(1);
+  std::vector<uint32_t> values;
+  uint32_t value;
+  while(std::fread(&value, sizeof(value), 1, in) == 1)
+    values.push_back(value);
+  std::fclose(in);
+  log.append(values);
+  log.advance(end);
+  if(cpu.retired >= end) finish_worker();
+}
+
+void interval_sampler::hand_over(uint64_t at) {
+  std::FILE * const out = fdopen(pending_fd, "wb");
+  const std::vector<uint32_t> values = log.since(pending_position);
+  log.forget(log.get_position());
+  if(!out || std::fwrite(&at, sizeof(at), 1, out) != 1
+     || std::fwrite(values.data(), sizeof(uint32_t), values.size(), out)
+     != values.size()
+     || std::fclose(out) != 0)
+    std::perror("cannot hand an interval to an analysis worker");
+  running.push_back(*pending);
+  pending.reset();
+}
+
+void interval_sampler::collect() {
+  const worker w = running.front();
+  running.pop_front();
+  int status;
+  while(waitpid(w.pid, &status, 0) == -1)
+    if(errno != EINTR) {
+      status = -1;
+      break;
+    }
+  if(status == 0) {
+    std::rewind(w.results);
+    analyser.merge(w.results);
+  }
+  else std::cerr << "an analysis worker failed; its interval is left out\n";
+  std::fclose(w.results);
+}
+
+void interval_sampler::finish_worker() {
+  analyser.save(results);
+  _exit(std::fflush(results) == 0 ? 0 : 1);
+}
+
+/* Stopping on an invalid instruction leaves it uncounted, so the worker
+   stops before it, unless it is not told about instructions and runs into
+   it. */
+void interval_sampler::finish() {
+  if(in_worker) finish_worker();
+  if(pending) hand_over(cpu.retired);
+  while(!running.empty()) collect();
+}
+
+static std::unique_ptr<input_log> sampled_inputs;
+static std::unique_ptr<interval_sampler> sampling;
+
+static void finish_sampling() {
+  if(sampling) sampling->finish();
+}
+
+/* Registered after the analysis, so that the workers' counts are added
+   before it reports. */
+void start_sampling(CPU& cpu, scheduler& sched, analysis& analyser,
+		    uint64_t interval, std::size_t jobs) {
+  sampled_inputs = std::make_unique<input_log>(nullptr, nullptr);
+  inputs = sampled_inputs.get();
+  sampling = std::make_unique<interval_sampler>(cpu, sched, *sampled_inputs,
+						analyser, interval, jobs);
+  cpu.drive(sched);
+  std::atexit(finish_sampling);
+  sampling->start();
+}
@@ -0,0 +1,79 @@
+// -*- C++ -*-
+#ifndef SAMPLING_H_
+#define SAMPLING_H_
+#include "cpu.h"
+#include "scheduler.h"
+#include <sys/types.h>
+#include <deque>
+#include <optional>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+
+class analysis;
+class input_log;
+
+/* Leaves a CPU to the uninstrumented engine, logging its inputs, and forks a
+   worker on starting and then from the scheduler at the end of the first
+   block after every so many instructions.  A worker is a snapshot of the
+   machine that waits until the next one is forked, is then handed where its
+   interval ends and the inputs logged during it, which the parent forgets,
+   and runs the interval again in the instrumented engine with the analysis
+   observing it through the sampler and its output dropped.  It saves the counts for the parent to add
+   to its own, starting with cold caches and predictor.  At most so many
+   workers run at once; the fast pass waits for the oldest otherwise. */
+class interval_sampler final : public observer {
+  struct worker {
+    pid_t pid;
+    std::FILE * results;
+  };
+
+  CPU& cpu;
+  scheduler& sched;
+  input_log& log;
+  analysis& analyser;
+  const std::uint64_t interval;
+  const std::size_t jobs;
+  std::deque<worker> running;
+
+  /* The worker forked last, its pipe and the log position it starts at. */
+  std::optional<worker> pending;
+  int pending_fd = -1;
+  std::size_t pending_position = 0;
+
+  /* In a worker, where its interval ends and where its counts go. */
+  bool in_worker = false;
+  std::uint64_t end = UINT64_MAX;
+  std::FILE * results = nullptr;
+
+  unsigned block(const cpu_state&) override;
+  void instruction(std::uint32_t, std::uint32_t) override;
+  void load(std::uint32_t, std::uint32_t, unsigned) override;
+  void store(std::uint32_t, std::uint32_t, unsigned) override;
+
+  task sample();
+  bool fork_worker();
+  void receive(int);
+  void hand_over(std::uint64_t);
+  void collect();
+  [[noreturn]] void finish_worker();
+
+public:
+  interval_sampler(CPU&, scheduler&, input_log&, analysis&, std::uint64_t,
+		   std::size_t);
+
+  /* Forks the first worker, which returns to run the CPU from the start, and
+     starts sampling in the parent. */
+  void start();
+
+  /* Hands the last interval over and adds the counts of all workers, or in a
+     worker that ran into the end of the program, saves its counts. */
+  void finish();
+};
+
+/* Samples the CPU into the analysis, which must not observe it, until the
+   program exits, driving the scheduler with it.  Called just before running
+   the CPU, as workers start from there. */
+void start_sampling(CPU&, scheduler&, analysis&, std::uint64_t, std::size_t);
+
+#endif
@@ -0,0 +1,105 @@
+#include "scheduler.h"
+#include "device.h"
+#include <sys/epoll.h>
+#include <algorithm>
+
+using std::uint64_t;
+
+void scheduler::at(uint64_t time, std::coroutine_handle<> handle) {
+  const std::lock_guard guard{lock};
+  wheel[(time >> slot_shift) % slots].push_back({time, seq++, handle});
+  if(time < next.load(std::memory_order_relaxed))
+    next.store(time, std::memory_order_relaxed);
+}
+
+void scheduler::post(std::coroutine_handle<> handle) {
+  const std::lock_guard guard{lock};
+  posted.push_back(handle);
+  next.store(0, std::memory_order_relaxed);
+}
+
+/* Finds the earliest event by looking at the slots in turn from the current
+   one, stopping at the first holding an event due within its span. */
+void scheduler::update_next() {
+  if(!posted.empty()) {
+    next.store(0, std::memory_order_relaxed);
+    return;
+  }
+  uint64_t earliest = UINT64_MAX;
+  const uint64_t first = current >> slot_shift;
+  for(uint64_t s = first; s < first + slots; s++) {
+    for(const entry& e : wheel[s % slots])
+      earliest = std::min(earliest, e.time);
+    if(earliest < (s + 1) << slot_shift) break;
+  }
+  next.store(earliest, std::memory_order_relaxed);
+}
+
+void scheduler::advance(uint64_t time) {
+  std::vector<entry> due;
+  std::vector<std::coroutine_handle<>> ready;
+  {
+    const std::lock_guard guard{lock};
+    const uint64_t first = current >> slot_shift;
+    const uint64_t last = time >> slot_shift;
+    for(uint64_t s = first; s <= last && s - first < slots; s++) {
+      auto& slot = wheel[s % slots];
+      const auto later = std::stable_partition(slot.begin(), slot.end(),
+					       [&](const entry& e) {
+						 return e.time > time;
+					       });
+      due.insert(due.end(), later, slot.end());
+      slot.erase(later, slot.end());
+    }
+    current = std::max(current, time);
+    ready.swap(posted);
+    update_next();
+  }
+  std::sort(due.begin(), due.end(), [](const entry& a, const entry& b) {
+    return a.time != b.time ? a.time < b.time : a.seq < b.seq;
+  });
+  for(const entry& e : due) e.handle.resume();
+  for(const auto handle : ready) handle.resume();
+}
+
+void scheduler::cancel(pending& p) {
+  bool found = false;
+  {
+    const std::lock_guard guard{lock};
+    auto& slot = wheel[(p.time >> slot_shift) % slots];
+    const auto it = std::find_if(slot.begin(), slot.end(),
+				 [&](const entry& e) {
+				   return e.handle == p.handle;
+				 });
+    if(it != slot.end()) {
+      slot.erase(it);
+      found = true;
+    }
+  }
+  if(found) p.handle.destroy();
+  p = {};
+}
+
+/* A host file epoll cannot watch, such as a regular file, never blocks.
+   Whichever of the reactor and cancel takes the coroutine from the wait
+   first resumes or destroys it. */
+void scheduler::readable_awaiter::await_suspend(std::coroutine_handle<> h) {
+  if(!wait.on_ready)
+    wait.on_ready = [&sched = sched, &wait = wait](std::uint32_t) {
+      if(const auto waiting = wait.waiting.exchange({}))
+	sched.post(waiting);
+    };
+  wait.waiting.store(h);
+  if(!reactor::instance().watch(wait.fd, EPOLLIN | EPOLLONESHOT,
+				wait.on_ready))
+    if(const auto waiting = wait.waiting.exchange({})) sched.post(waiting);
+}
+
+void scheduler::readable_awaiter::await_resume() const {
+  reactor::instance().unwatch(wait.fd);
+}
+
+void scheduler::cancel(readable_wait& wait) {
+  reactor::instance().unwatch(wait.fd);
+  if(const auto waiting = wait.waiting.exchange({})) waiting.destroy();
+}
@@ -0,0 +1,133 @@
+// -*- C++ -*-
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+#include <coroutine>
+#include <exception>
+#include <array>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <functional>
+#include <cstdint>
+
+/* A coroutine run for its effects, which starts at once and is destroyed
+   when it finishes.  Device models are written as such coroutines, awaiting
+   guest time or host I/O from a scheduler. */
+struct task {
+  struct promise_type {
+    task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+/* Guest-time events, in instructions run by the CPU driving the scheduler,
+   which advances it at the end of each block and whose published count is
+   the guest time.  Coroutines awaiting a delay
+   resume in the order they are due, at the end of the first block reaching
+   that time, and those awaiting host I/O at the end of the first block after
+   it completes, all on the thread of that CPU.  Pending events sit in a
+   timing wheel of slots covering a span of guest time each; those due after
+   a whole turn of the wheel wait in their slot for later turns. */
+class scheduler {
+  static constexpr std::size_t slots = 256;
+  static constexpr int slot_shift = 6;
+
+  struct entry {
+    std::uint64_t time;
+    std::uint64_t seq;
+    std::coroutine_handle<> handle;
+  };
+
+  std::mutex lock;
+  std::array<std::vector<entry>, slots> wheel;
+  std::vector<std::coroutine_handle<>> posted;
+  std::uint64_t current = 0;
+  std::uint64_t seq = 0;
+  std::atomic<std::uint64_t> next{UINT64_MAX};
+  const std::atomic<std::uint64_t> * clock = nullptr;
+
+  void update_next();
+  void at(std::uint64_t, std::coroutine_handle<>);
+  void post(std::coroutine_handle<>);
+
+public:
+  /* Takes the guest time from the count, which the driving CPU publishes at
+     the end of each block. */
+  void set_clock(const std::atomic<std::uint64_t>& count) { clock = &count; }
+
+  /* The guest time as of the last block ended. */
+  std::uint64_t now() const {
+    return clock ? clock->load(std::memory_order_relaxed) : 0;
+  }
+
+  /* The guest time of the next event, or 0 if one is ready now. */
+  std::uint64_t due() const { return next.load(std::memory_order_relaxed); }
+
+  /* Runs the events due by the guest time. */
+  void advance(std::uint64_t);
+
+  /* A delay a coroutine awaits, which can be cancelled while pending. */
+  struct pending {
+    std::uint64_t time = 0;
+    std::coroutine_handle<> handle{};
+
+    explicit operator bool() const { return bool(handle); }
+  };
+
+  struct delay_awaiter {
+    scheduler& sched;
+    std::uint64_t time;
+    pending * out;
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<> h) {
+      if(out) *out = {time, h};
+      sched.at(time, h);
+    }
+    void await_resume() const {}
+  };
+
+  /* A wait for a host file to become readable, which can be cancelled while
+     pending.  The reactor may still report on it after that, so it must
+     outlive the file, and be reused for later waits on the same file. */
+  struct readable_wait {
+    int fd = -1;
+    std::atomic<std::coroutine_handle<>> waiting{};
+    std::function<void(std::uint32_t)> on_ready;
+  };
+
+  struct readable_awaiter {
+    scheduler& sched;
+    readable_wait& wait;
+
+    bool await_ready() const { return false; }
+    void await_suspend(std::coroutine_handle<>);
+    void await_resume() const;
+  };
+
+  /* Resumes the coroutine the number of guest instructions from now,
+     recording the pending delay in the second argument if given. */
+  delay_awaiter delay(std::uint64_t instructions, pending * out = nullptr) {
+    return { *this, now() + instructions, out };
+  }
+
+  /* Drops the delay and destroys the coroutine awaiting it, unless it is due
+     and already being resumed, and clears it. */
+  void cancel(pending&);
+
+  /* Resumes the coroutine once the host file can be read without
+     blocking. */
+  readable_awaiter readable(int fd, readable_wait& wait) {
+    wait.fd = fd;
+    return { *this, wait };
+  }
+
+  /* Stops watching the file and destroys the coroutine waiting on it, unless
+     it is already being resumed. */
+  void cancel(readable_wait&);
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "server.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#include <iostream>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int listen_on(const char * path) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if(std::strlen(path) >= sizeof(addr.sun_path)) {
+    std::cerr << "socket path too long: " << path << '\n';
+    std::exit(-1);
+  }
+  std::strcpy(addr.sun_path, path);
+  unlink(path);
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd == -1
+     || bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1
+     || listen(fd, SOMAXCONN) == -1) {
+    std::cerr << "cannot listen on " << path << ": ";
+    std::perror("");
+    std::exit(-3);
+  }
+  return fd;
+}
+
+void serve(const char * path) {
+  const int fd = listen_on(path);
+  signal(SIGCHLD, SIG_IGN);
+  while(true) {
+    const int conn = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+    if(conn == -1) {
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      std::perror("cannot accept job");
+      std::exit(-3);
+    }
+    const pid_t pid = fork();
+    if(pid == 0) {
+      signal(SIGCHLD, SIG_DFL);
+      close(fd);
+      for(int i = 0; i < 3; i++)
+	if(dup2(conn, i) == -1) {
+	  std::perror("cannot redirect job");
+	  std::_Exit(-3);
+	}
+      close(conn);
+      return;
+    }
+    if(pid == -1) std::perror("cannot fork job");
+    close(conn);
+  }
+}
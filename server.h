@@ -0,0 +1,16 @@
+// -*- C++ -*-
+#ifndef SERVER_H_
+#define SERVER_H_
+
+/* Listens on a Unix stream socket at the path, replacing any file there, and
+   returns its descriptor.  Exits if it cannot. */
+int listen_on(const char*);
+
+/* Listens on a Unix socket at the path and forks for each connection, which
+   is a job: serve returns in the child with the connection as its standard
+   input, output and error, so that the job carries on from the machine as it
+   stands, sharing its memory copy-on-write.  The parent never returns, and
+   reaps finished jobs without waiting for them. */
+void serve(const char*);
+
+#endif